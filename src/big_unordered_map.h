@@ -7,6 +7,7 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/serialization/utility.hpp>
+#include <boost/serialization/vector.hpp>
 #include <limits>
 #include <vector>
 #endif
@@ -16,18 +17,23 @@
 #include <unordered_map>
 #include <utility>
 
+#include "flat_hash_map.h"
+
+// Default bound of the combiner entries, a few MB per process for the PT keys and sums.
+const std::size_t BIG_UNORDERED_MAP_COMBINER_SIZE_DEFAULT = 1 << 16;
+
 #ifdef SERIAL
 // Wrap normal hash map into the BigUnorderedMap interface.
 template <class K, class V, class H>
 class BigUnorderedMap {
  public:
-  BigUnorderedMap(const std::pair<K, V>& skeleton) {}
+  BigUnorderedMap(const std::size_t = BIG_UNORDERED_MAP_COMBINER_SIZE_DEFAULT) {}
 
   void reserve(unsigned long long n_buckets) { local_map.reserve(n_buckets); }
 
   unsigned long long bucket_count() const { return local_map.bucket_count(); }
 
-  std::unordered_map<K, V, H>& get_local_map() { return local_map; }
+  FlatHashMap<K, V, H>& get_local_map() { return local_map; }
 
   void async_inc(const K& k, const V v) { local_map[k] += v; }
 
@@ -37,21 +43,25 @@ class BigUnorderedMap {
 
   long long unsigned int size() const { return local_map.size(); }
 
+  void clear() { local_map.clear(); }
+
  protected:
-  std::unordered_map<K, V, H> local_map;
+  FlatHashMap<K, V, H> local_map;
 };
 #else
 // Distributed version for production run.
+// Remote increments are first summed in a bounded local combiner, which is flushed when full,
+// then grouped per target process and shipped in batches of buf_size records.
 template <class K, class V, class H>
 class BigUnorderedMap {
  public:
-  BigUnorderedMap(const std::pair<K, V>& skeleton);
+  BigUnorderedMap(const std::size_t combiner_size = BIG_UNORDERED_MAP_COMBINER_SIZE_DEFAULT);
 
   void reserve(unsigned long long n_buckets);
 
   unsigned long long bucket_count() const;
 
-  const std::unordered_map<K, V, H>& get_local_map() { return local_map; }
+  const FlatHashMap<K, V, H>& get_local_map() { return local_map; }
 
   void async_inc(const K&, const V);
 
@@ -63,6 +73,9 @@ class BigUnorderedMap {
 
   long long unsigned int size() const;
 
+  // Remove all entries but keep the capacity, for reuse after complete_async_incs.
+  void clear() { local_map.clear(); }
+
  protected:
   // Basic MPI info.
   std::size_t proc_id;
@@ -72,53 +85,62 @@ class BigUnorderedMap {
   // Hash function.
   H hasher;
 
-  // Local hash map.
-  std::unordered_map<K, V, H> local_map;
+  // Local hash map, storing keys inline.
+  FlatHashMap<K, V, H> local_map;
 
-  // Buffers.
-  std::vector<std::pair<K, V> > buf_send;
-  std::vector<boost::mpi::content> buf_send_content;
-  std::pair<K, V> buf_recv;
-  boost::mpi::content buf_recv_content;
+  // Pre-aggregation of remote increments, at most combiner_size entries, and no more than the
+  // local share reserved. 0 to disable.
+  FlatHashMap<K, V, H> combiner;
+  std::size_t combiner_size;
+
+  // Buffers, one per target process, unused for this process. Duplicate keys are summed before
+  // sending.
+  std::vector<FlatHashMap<K, V, H> > buf_sends;
+  std::vector<std::pair<K, V> > buf_pack;
+  std::vector<std::pair<K, V> > buf_recv;
   std::list<boost::mpi::request> reqs;
-  std::size_t buf_send_cnt;
   std::size_t buf_size;
 
-  // Counters.
+  // Counters of batch messages.
   std::vector<unsigned long long> send_cnts;
   std::vector<unsigned long long> recv_cnts;
   std::vector<unsigned long long> recv_totals;
-  std::vector<unsigned long long> recv_trunk_totals;
 
   // MPI tags.
-  enum { TAG_NODE_INFO, TAG_KV, TAG_TRUNK_FINISH, TAG_FINISH };
+  enum { TAG_NODE_INFO, TAG_KV, TAG_FINISH };
 
   // Proc infos.
   std::size_t total_proc_buckets;
   std::size_t local_proc_buckets;
   std::vector<std::size_t> proc_map;
 
-  void set_skeleton(const std::pair<K, V>&);
-
   void reset_cnts();
 
   void set_proc_buckets();
 
-  void complete_async_inc_trunk();
+  void flush_combiner();
+
+  void send_buf(const std::size_t target);
+
+  // Receive and merge the batches already arrived, without blocking.
+  void recv_bufs();
+
+  void recv_buf(const int source);
+
+  void free_completed_reqs();
 };
 
 template <class K, class V, class H>
-BigUnorderedMap<K, V, H>::BigUnorderedMap(const std::pair<K, V>& skeleton) {
-  const std::size_t TOTAL_BUF_SIZE = 10000;
-  const std::size_t MIN_BUF_SIZE = 100;
+BigUnorderedMap<K, V, H>::BigUnorderedMap(const std::size_t combiner_size)
+    : combiner_size(combiner_size) {
+  const std::size_t TOTAL_BUF_SIZE = 1 << 18;
+  const std::size_t MIN_BUF_SIZE = 1000;
   proc_id = world.rank();
   n_procs = world.size();
   hasher = H();
   buf_size = std::max(TOTAL_BUF_SIZE / n_procs, MIN_BUF_SIZE);
-  buf_send.resize(buf_size);
-  buf_send_content.resize(buf_size);
+  buf_sends.resize(n_procs);
   reset_cnts();
-  set_skeleton(skeleton);
   set_proc_buckets();
 }
 
@@ -131,23 +153,11 @@ unsigned long long BigUnorderedMap<K, V, H>::bucket_count() const {
   return total_bucket_count;
 }
 
-template <class K, class V, class H>
-void BigUnorderedMap<K, V, H>::set_skeleton(const std::pair<K, V>& skeleton) {
-  for (std::size_t i = 0; i < buf_size; i++) {
-    buf_send[i] = skeleton;
-    buf_send_content[i] = boost::mpi::get_content(buf_send[i]);
-  }
-  buf_recv = skeleton;
-  buf_recv_content = boost::mpi::get_content(buf_recv);
-}
-
 template <class K, class V, class H>
 void BigUnorderedMap<K, V, H>::reset_cnts() {
-  buf_send_cnt = 0;
   send_cnts.assign(n_procs, 0);
   recv_cnts.assign(n_procs, 0);
   recv_totals.assign(n_procs, std::numeric_limits<unsigned long long>::max());
-  recv_trunk_totals.assign(n_procs, std::numeric_limits<unsigned long long>::max());
 }
 
 template <class K, class V, class H>
@@ -217,6 +227,13 @@ void BigUnorderedMap<K, V, H>::reserve(const unsigned long long n_buckets) {
   std::size_t local_buckets =
       static_cast<std::size_t>(n_buckets * local_proc_buckets / total_proc_buckets + 1);
   local_map.reserve(local_buckets);
+
+  // The remote keys of the other processes are about as many as the local ones.
+  combiner_size = std::min(combiner_size, local_buckets);
+  combiner.reserve(combiner_size);
+  for (std::size_t i = 0; i < n_procs; i++) {
+    if (i != proc_id) buf_sends[i].reserve(buf_size);
+  }
   world.barrier();
 }
 
@@ -237,80 +254,84 @@ void BigUnorderedMap<K, V, H>::async_inc(const K& key, const V value) {
   // Process locally.
   if (target == proc_id) {
     local_map[get_storage_key(key)] += value;
-    send_cnts[proc_id]++;
     return;
   }
 
-  // Send to target asynchronously.
-  buf_send[buf_send_cnt].first = key;
-  buf_send[buf_send_cnt].second = value;
-  reqs.push_front(world.isend(target, TAG_KV, buf_send_content[buf_send_cnt]));
-  send_cnts[target]++;
-  if (send_cnts[target] == std::numeric_limits<unsigned long long>::max()) {
-    printf("Maximum sends reached. Call complete async first.\n");
-    exit(1);
+  if (combiner_size > 0) {
+    combiner[key] += value;
+    if (combiner.size() >= combiner_size) flush_combiner();
+    return;
   }
-  buf_send_cnt++;
-
-  if (buf_send_cnt == buf_size) {
-    // When buffer is full, wait and process a trunk.
-    // A trunk contains 'buf_size' send-requests from each process.
-    for (std::size_t i = 0; i < n_procs; i++) {
-      if (i == proc_id) continue;
-      reqs.push_front(world.isend(i, TAG_TRUNK_FINISH, send_cnts[i]));
-    }
-    complete_async_inc_trunk();
+
+  // Combine into the buffer of the target and ship once full.
+  auto& buf_send = buf_sends[target];
+  buf_send[key] += value;
+  if (buf_send.size() >= buf_size) {
+    send_buf(target);
+    recv_bufs();
+    free_completed_reqs();
   }
 }
 
 template <class K, class V, class H>
-void BigUnorderedMap<K, V, H>::complete_async_inc_trunk() {
-  std::size_t n_active_procs = 0;
-  std::size_t trunk_finish_cnt = 0;
-  for (std::size_t i = 0; i < n_procs; i++) {
-    if (recv_cnts[i] < recv_totals[i] && i != proc_id) n_active_procs++;
+void BigUnorderedMap<K, V, H>::flush_combiner() {
+  for (const auto& kv : combiner) {
+    const std::size_t target = get_target(kv.first);
+    auto& buf_send = buf_sends[target];
+    buf_send[kv.first] += kv.second;
+    if (buf_send.size() >= buf_size) send_buf(target);
   }
-  while (trunk_finish_cnt < n_active_procs) {
-    const auto& status = world.probe();
-    const std::size_t source = status.source();
-    const std::size_t tag = status.tag();
-    switch (tag) {
-      case TAG_KV: {
-        world.recv(source, tag, buf_recv_content);
-        const K& key = buf_recv.first;
-        const V& value = buf_recv.second;
-        local_map[get_storage_key(key)] += value;
-        recv_cnts[source]++;
-        if (recv_cnts[source] == recv_trunk_totals[source]) {
-          trunk_finish_cnt++;
-        }
-        break;
-      }
-      case TAG_TRUNK_FINISH: {
-        world.recv(source, TAG_TRUNK_FINISH, recv_trunk_totals[source]);
-        if (recv_trunk_totals[source] == recv_cnts[source]) {
-          trunk_finish_cnt++;
-        }
-        break;
-      }
-      case TAG_FINISH: {
-        world.recv(source, TAG_FINISH, recv_totals[source]);
-        if (recv_totals[source] == recv_cnts[source]) trunk_finish_cnt++;
-        break;
-      }
+  combiner.clear();
+  recv_bufs();
+  free_completed_reqs();
+}
+
+template <class K, class V, class H>
+void BigUnorderedMap<K, V, H>::send_buf(const std::size_t target) {
+  auto& buf_send = buf_sends[target];
+  if (buf_send.empty()) return;
+  buf_pack.assign(buf_send.begin(), buf_send.end());
+  buf_send.clear();
+  reqs.push_front(world.isend(target, TAG_KV, buf_pack));  // Serialized upon isend.
+  send_cnts[target]++;
+}
+
+template <class K, class V, class H>
+void BigUnorderedMap<K, V, H>::recv_bufs() {
+  while (true) {
+    const auto& status = world.iprobe(boost::mpi::any_source, TAG_KV);
+    if (!status) break;
+    recv_buf(status->source());
+  }
+}
+
+template <class K, class V, class H>
+void BigUnorderedMap<K, V, H>::recv_buf(const int source) {
+  world.recv(source, TAG_KV, buf_recv);
+  for (const auto& kv : buf_recv) local_map[get_storage_key(kv.first)] += kv.second;
+  recv_cnts[source]++;
+}
+
+template <class K, class V, class H>
+void BigUnorderedMap<K, V, H>::free_completed_reqs() {
+  auto it = reqs.begin();
+  while (it != reqs.end()) {
+    if (it->test()) {
+      it = reqs.erase(it);
+    } else {
+      it++;
     }
   }
-  wait_all(reqs.begin(), reqs.end());
-  reqs.clear();
-  buf_send_cnt = 0;
-  recv_trunk_totals.assign(n_procs, std::numeric_limits<unsigned long long>::max());
 }
 
 template <class K, class V, class H>
 void BigUnorderedMap<K, V, H>::complete_async_incs() {
+  // Flush remaining buffers and tell each process how many batches to expect.
+  flush_combiner();
   std::size_t n_active_procs = 0;
   for (std::size_t i = 0; i < n_procs; i++) {
     if (i == proc_id) continue;
+    send_buf(i);
     reqs.push_front(world.isend(i, TAG_FINISH, send_cnts[i]));
     if (recv_cnts[i] < recv_totals[i]) n_active_procs++;
   }
@@ -321,18 +342,10 @@ void BigUnorderedMap<K, V, H>::complete_async_incs() {
     const int tag = status.tag();
     switch (tag) {
       case TAG_KV: {
-        world.recv(source, tag, buf_recv_content);
-        const K& key = buf_recv.first;
-        const V& value = buf_recv.second;
-        local_map[get_storage_key(key)] += value;
-        recv_cnts[source]++;
+        recv_buf(source);
         if (recv_cnts[source] == recv_totals[source]) n_active_procs--;
         break;
       }
-      case TAG_TRUNK_FINISH: {
-        world.recv(source, TAG_TRUNK_FINISH, recv_trunk_totals[source]);
-        break;
-      }
       case TAG_FINISH: {
         world.recv(source, TAG_FINISH, recv_totals[source]);
         if (recv_totals[source] == recv_cnts[source]) n_active_procs--;
@@ -342,6 +355,8 @@ void BigUnorderedMap<K, V, H>::complete_async_incs() {
   }
   wait_all(reqs.begin(), reqs.end());
   reqs.clear();
+  buf_pack.clear();
+  buf_recv.clear();
   reset_cnts();
   world.barrier();
 }
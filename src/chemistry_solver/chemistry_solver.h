@@ -15,9 +15,10 @@ class ChemistrySolver : public Solver {
 
   double hamiltonian(const Det&, const Det&) const override { return 0.0; };
 
-  std::list<Det> find_connected_dets(const Det&, const double) const override {
-    return std::list<Det>();
-  }
+  double hamiltonian(const Excitation&) const override { return 0.0; };
+
+  void find_connected_excitations(const Det&, const double, const ExcitationHandler&)
+      const override {}
 
  public:
   static void run() { ChemistrySolver::get_instance().solve(); }
@@ -0,0 +1,38 @@
+#ifndef HCI_COMPENSATED_DOUBLE_H_
+#define HCI_COMPENSATED_DOUBLE_H_
+
+#include "std.h"
+
+// Double with the rounding errors of its additions carried in a second double (two-sum), which
+// gives sums about as accurate as twice the precision. Branch free so that loops vectorize.
+// Relies on strict IEEE rounding, i.e. must not be built with -ffast-math.
+class CompensatedDouble {
+ public:
+  CompensatedDouble(const double value = 0.0) : sum(value), compensation(0.0) {}
+
+  CompensatedDouble& operator+=(const double value) {
+    const double sum_new = sum + value;
+    const double value_rounded = sum_new - sum;
+    compensation += (sum - (sum_new - value_rounded)) + (value - value_rounded);
+    sum = sum_new;
+    return *this;
+  }
+
+  CompensatedDouble& operator+=(const CompensatedDouble& rhs) {
+    *this += rhs.sum;
+    compensation += rhs.compensation;
+    return *this;
+  }
+
+  double get_sum() const { return sum; }
+
+  double get_compensation() const { return compensation; }
+
+  double get_value() const { return sum + compensation; }
+
+ private:
+  double sum;
+  double compensation;
+};
+
+#endif
@@ -0,0 +1,22 @@
+#include "compensated_double.h"
+#include "gtest/gtest.h"
+
+TEST(CompensatedDoubleTest, SmallTermsOnLargeSum) {
+  CompensatedDouble compensated(1.0);
+  double naive = 1.0;
+  for (int i = 0; i < 10000; i++) {
+    compensated += 1.0e-16;
+    naive += 1.0e-16;
+  }
+  EXPECT_EQ(naive, 1.0);
+  EXPECT_DOUBLE_EQ(compensated.get_value(), 1.0 + 1.0e-12);
+}
+
+TEST(CompensatedDoubleTest, AddCompensated) {
+  CompensatedDouble lhs(1.0e16);
+  CompensatedDouble rhs(-1.0e16);
+  lhs += 1.0;
+  rhs += 1.0;
+  lhs += rhs;
+  EXPECT_EQ(lhs.get_value(), 2.0);
+}
@@ -26,6 +26,10 @@ class Config {
     boost::property_tree::read_json(filename, Config::get_config_tree());
   }
 
+  static bool has(const std::string& property) {
+    return static_cast<bool>(Config::get_config_tree().get_child_optional(property));
+  }
+
   template <class T>
   static T get(const std::string& property) {
     return Config::get_config_tree().get<T>(property);
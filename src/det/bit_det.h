@@ -0,0 +1,116 @@
+#ifndef HCI_BIT_DET_H_
+#define HCI_BIT_DET_H_
+
+#include "../std.h"
+
+#include "../types.h"
+#include "bit_spin_det.h"
+#include "det.h"
+
+// Largest number of 64-bit words per spin supported by the bitstring dets, 2048 orbitals, enough
+// for rcut 7.5 of config.json.template2.
+const std::size_t BIT_DET_N_WORDS_MAX = 32;
+
+template <std::size_t N>
+class BitDet {
+ public:
+  BitSpinDet<N> up;
+  BitSpinDet<N> dn;
+
+  BitDet() {}
+
+  explicit BitDet(const Det& det) : up(det.up), dn(det.dn) {}
+
+  Det to_det() const {
+    Det det;
+    det.up = up.to_spin_det();
+    det.dn = dn.to_spin_det();
+    return det;
+  }
+
+  bool get_orb(const int orb_id, const int dn_offset) const {
+    if (orb_id < dn_offset) return up.get_orb(orb_id);
+    return dn.get_orb(orb_id - dn_offset);
+  }
+
+  void set_orb(const int orb_id, const int dn_offset, const bool occ) {
+    if (orb_id < dn_offset) {
+      up.set_orb(orb_id, occ);
+    } else {
+      dn.set_orb(orb_id - dn_offset, occ);
+    }
+  }
+
+  void from_eor(const BitDet& lhs, const BitDet& rhs) {
+    up.from_eor(lhs.up, rhs.up);
+    dn.from_eor(lhs.dn, rhs.dn);
+  }
+
+  std::size_t get_n_diffs(const BitDet& rhs) const {
+    return up.get_n_diffs(rhs.up) + dn.get_n_diffs(rhs.dn);
+  }
+
+  // Number of spin orbitals needed to hold the det, counting both spins.
+  std::size_t get_n_orbs_used() const {
+    return std::max(up.get_n_orbs_used(), dn.get_n_orbs_used()) * 2;
+  }
+
+  // Same order as Det: the lowest orbital occupied in only one of the spins is up.
+  bool is_spin_flip_canonical() const {
+    const auto& up_words = up.get_words();
+    const auto& dn_words = dn.get_words();
+    for (std::size_t k = 0; k < N; k++) {
+      const std::uint64_t diff = up_words[k] ^ dn_words[k];
+      if (diff != 0) return (up_words[k] & diff & (~diff + 1)) != 0;
+    }
+    return true;
+  }
+
+  void flip_spins() { std::swap(up, dn); }
+
+  bool operator==(const BitDet& rhs) const { return up == rhs.up && dn == rhs.dn; }
+
+  template <class Archive>
+  void serialize(Archive& ar, const unsigned int) {
+    ar& up;
+    ar& dn;
+  }
+};
+
+template <std::size_t N>
+class BitDetHasher {
+ public:
+  std::size_t operator()(const BitDet<N>& det) const {
+    std::uint64_t hash = 0;
+    for (const std::uint64_t word : det.up.get_words()) hash = mix(hash ^ word);
+    for (const std::uint64_t word : det.dn.get_words()) hash = mix(hash ^ word);
+    return static_cast<std::size_t>(hash);
+  }
+
+ private:
+  static std::uint64_t mix(std::uint64_t hash) {
+    hash *= 0xFF51AFD7ED558CCDULL;
+    return hash ^ (hash >> 33);
+  }
+};
+
+// Number of 64-bit words needed for n_orbs spatial orbitals per spin.
+inline std::size_t get_n_bit_det_words(const std::size_t n_orbs) {
+  const std::size_t n_words = (n_orbs + 63) / 64;
+  if (n_words > BIT_DET_N_WORDS_MAX) {
+    throw std::invalid_argument("Too many orbitals for the bitstring dets.");
+  }
+  return std::max(n_words, static_cast<std::size_t>(1));
+}
+
+// Smallest width with instantiated bitstring det code holding n_words words, see the dispatch in
+// HEGSolver. Widths grow by about half beyond 4 words so that at most a third is padding.
+inline std::size_t get_bit_det_width(const std::size_t n_words) {
+  const std::size_t WIDTHS[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, BIT_DET_N_WORDS_MAX};
+  for (const std::size_t width : WIDTHS) {
+    if (width >= n_words) return width;
+  }
+  throw std::invalid_argument("Too many orbitals for the bitstring dets.");
+}
+
+#endif
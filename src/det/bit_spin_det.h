@@ -0,0 +1,105 @@
+#ifndef HCI_BIT_SPIN_DET_H_
+#define HCI_BIT_SPIN_DET_H_
+
+#include "../std.h"
+
+#include "../types.h"
+#include "spin_det.h"
+
+// Fixed width bitstring spin det with N 64-bit words, i.e. up to 64 * N orbitals.
+// Lives on the stack so that copies and comparisons never allocate.
+template <std::size_t N>
+class BitSpinDet {
+ public:
+  BitSpinDet() { words.fill(0); }
+
+  explicit BitSpinDet(const SpinDet& spin_det) { from_spin_det(spin_det); }
+
+  void from_spin_det(const SpinDet& spin_det) {
+    words.fill(0);
+    for (const Orbital orb_id : spin_det.get_elec_orbs()) set_orb(orb_id, true);
+  }
+
+  SpinDet to_spin_det() const {
+    Orbitals orbs(get_n_elecs());
+    get_elec_orbs(orbs.data(), orbs.size());
+    SpinDet spin_det;
+    spin_det.decode(orbs, SpinDet::EncodeScheme::FIXED);
+    return spin_det;
+  }
+
+  void set_orb(const int orb_id, const bool occ) {
+    const std::uint64_t mask = 1ULL << (orb_id & 63);
+    if (occ) {
+      words[orb_id >> 6] |= mask;
+    } else {
+      words[orb_id >> 6] &= ~mask;
+    }
+  }
+
+  bool get_orb(const int orb_id) const { return (words[orb_id >> 6] >> (orb_id & 63)) & 1ULL; }
+
+  std::size_t get_n_elecs() const {
+    std::size_t n_elecs = 0;
+    for (std::size_t i = 0; i < N; i++) n_elecs += __builtin_popcountll(words[i]);
+    return n_elecs;
+  }
+
+  // Number of electrons in the orbitals lower than orb_id.
+  std::size_t get_n_elecs_below(const int orb_id) const {
+    const std::size_t word_id = orb_id >> 6;
+    std::size_t n_elecs = 0;
+    for (std::size_t i = 0; i < word_id; i++) n_elecs += __builtin_popcountll(words[i]);
+    const std::uint64_t mask = (1ULL << (orb_id & 63)) - 1;
+    return n_elecs + __builtin_popcountll(words[word_id] & mask);
+  }
+
+  // Number of electrons of this not present in rhs, i.e. the excitation degree.
+  std::size_t get_n_diffs(const BitSpinDet& rhs) const {
+    std::size_t n_diffs = 0;
+    for (std::size_t i = 0; i < N; i++) n_diffs += __builtin_popcountll(words[i] & ~rhs.words[i]);
+    return n_diffs;
+  }
+
+  void from_eor(const BitSpinDet& lhs, const BitSpinDet& rhs) {
+    for (std::size_t i = 0; i < N; i++) words[i] = lhs.words[i] ^ rhs.words[i];
+  }
+
+  // Write occupied orbitals into orbs in ascending order, at most n_max of them.
+  // Returns the number of orbitals written.
+  std::size_t get_elec_orbs(Orbital* orbs, const std::size_t n_max) const {
+    std::size_t n_elecs = 0;
+    for (std::size_t i = 0; i < N; i++) {
+      std::uint64_t word = words[i];
+      while (word != 0 && n_elecs < n_max) {
+        orbs[n_elecs++] = static_cast<Orbital>((i << 6) + __builtin_ctzll(word));
+        word &= word - 1;
+      }
+    }
+    return n_elecs;
+  }
+
+  // One plus the highest occupied orbital, 0 if empty.
+  std::size_t get_n_orbs_used() const {
+    for (std::size_t i = N; i > 0; i--) {
+      if (words[i - 1] != 0) return ((i - 1) << 6) + 64 - __builtin_clzll(words[i - 1]);
+    }
+    return 0;
+  }
+
+  const std::array<std::uint64_t, N>& get_words() const { return words; }
+
+  template <class Archive>
+  void serialize(Archive& ar, const unsigned int) {
+    for (auto& word : words) ar& word;
+  }
+
+  bool operator==(const BitSpinDet& rhs) const { return words == rhs.words; }
+
+  bool operator!=(const BitSpinDet& rhs) const { return words != rhs.words; }
+
+ private:
+  std::array<std::uint64_t, N> words;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "bit_spin_det.h"
+#include "bit_det.h"
+#include "gtest/gtest.h"
+
+TEST(BitSpinDetTest, SetAndGetOrbitals) {
+  BitSpinDet<2> spin_det;
+  EXPECT_FALSE(spin_det.get_orb(70));
+  spin_det.set_orb(70, true);
+  spin_det.set_orb(5, true);
+  EXPECT_TRUE(spin_det.get_orb(70));
+  EXPECT_TRUE(spin_det.get_orb(5));
+  EXPECT_EQ(spin_det.get_n_elecs(), 2);
+  spin_det.set_orb(5, false);
+  EXPECT_FALSE(spin_det.get_orb(5));
+  EXPECT_EQ(spin_det.get_n_elecs(), 1);
+}
+
+TEST(BitSpinDetTest, ConvertFromSpinDet) {
+  SpinDet spin_det;
+  spin_det.set_orb(1, true);
+  spin_det.set_orb(64, true);
+  spin_det.set_orb(100, true);
+  const BitSpinDet<2> bit_spin_det(spin_det);
+  Orbital orbs[3];
+  EXPECT_EQ(bit_spin_det.get_elec_orbs(orbs, 3), 3);
+  EXPECT_EQ(orbs[0], 1);
+  EXPECT_EQ(orbs[1], 64);
+  EXPECT_EQ(orbs[2], 100);
+  EXPECT_EQ(bit_spin_det.get_n_elecs_below(64), 1);
+  EXPECT_EQ(bit_spin_det.get_n_elecs_below(101), 3);
+}
+
+TEST(BitSpinDetTest, FromEORAndDiffs) {
+  BitSpinDet<2> spin_det1, spin_det2, spin_det3;
+  spin_det1.set_orb(1, true);
+  spin_det1.set_orb(2, true);
+  spin_det2.set_orb(2, true);
+  spin_det2.set_orb(80, true);
+  spin_det3.from_eor(spin_det1, spin_det2);
+  EXPECT_EQ(spin_det3.get_n_elecs(), 2);
+  EXPECT_TRUE(spin_det3.get_orb(1));
+  EXPECT_TRUE(spin_det3.get_orb(80));
+  EXPECT_EQ(spin_det1.get_n_diffs(spin_det2), 1);
+  EXPECT_EQ(spin_det1.get_n_diffs(spin_det1), 0);
+}
+
+TEST(BitSpinDetTest, SpinFlipCanonicalAsDet) {
+  Det det;
+  det.up.set_orb(3, true);
+  det.up.set_orb(70, true);
+  det.dn.set_orb(3, true);
+  det.dn.set_orb(5, true);
+  EXPECT_FALSE(det.is_spin_flip_canonical());
+  EXPECT_FALSE(BitDet<2>(det).is_spin_flip_canonical());
+  det.flip_spins();
+  EXPECT_TRUE(det.is_spin_flip_canonical());
+  BitDet<2> bit_det(det);
+  EXPECT_TRUE(bit_det.is_spin_flip_canonical());
+  bit_det.flip_spins();
+  EXPECT_FALSE(bit_det.is_spin_flip_canonical());
+  det.dn = det.up;
+  EXPECT_TRUE(det.is_spin_flip_canonical());
+  EXPECT_TRUE(BitDet<2>(det).is_spin_flip_canonical());
+}
@@ -16,17 +16,6 @@ class Det {
     return dn.get_orb(orb_id - dn_offset);
   }
 
-  static Orbital get_n_orbs_used(
-      const OrbitalsPair& pair,
-      const SpinDet::EncodeScheme scheme = SpinDet::EncodeScheme::VARIABLE) {
-    if (scheme != SpinDet::EncodeScheme::VARIABLE) {
-      throw std::invalid_argument("Only VARIABLE encode scheme implemented.");
-    }
-    Orbital n_orbs_used_up = pair.first.size() == 1 ? pair.first.size() : pair.first.back() + 1;
-    Orbital n_orbs_used_dn = pair.second.size() == 1 ? pair.second.size() : pair.second.back() + 1;
-    return std::max(n_orbs_used_up, n_orbs_used_dn) * 2;
-  }
-
   void set_orb(const int orb_id, const int dn_offset, const bool occ) {
     if (orb_id < dn_offset) {
       up.set_orb(orb_id, occ);
@@ -51,6 +40,12 @@ class Det {
     up.decode(code.first, scheme);
     dn.decode(code.second, scheme);
   }
+
+  // Whether up does not come after dn as sorted lists of orbitals, i.e. the det represents itself
+  // and its spin flip partner.
+  bool is_spin_flip_canonical() const { return !(dn.get_elec_orbs() < up.get_elec_orbs()); }
+
+  void flip_spins() { std::swap(up, dn); }
 };
 
 bool operator==(const Det&, const Det&);
@@ -0,0 +1,170 @@
+#ifndef HCI_DET_SET_H_
+#define HCI_DET_SET_H_
+
+#include "../std.h"
+
+#include "../types.h"
+#include "bit_det.h"
+#include "det.h"
+
+// Open addressing hash set of dets stored as bitstrings of n_words 64-bit words per spin.
+// The words and the 64-bit hash of each det live inline in contiguous arrays, and the words are
+// only compared for slots with the same hash. The width grows with the widest det inserted.
+class DetSet {
+ public:
+  DetSet() : n_words(1), n_entries(0), n_bits(0) {}
+
+  // Whether the det was not in the set.
+  bool insert(const Det& det) {
+    const std::size_t n_words_det = get_n_words(det);
+    if (n_words_det > n_words) rehash(get_n_buckets_min(0), n_words_det);
+    if ((n_entries + 1) > bucket_count() * MAX_LOAD_FACTOR) {
+      rehash(get_n_buckets_min(n_entries + 1), n_words);
+    }
+    Key key;
+    to_key(det, key);
+    const std::uint64_t hash = get_hash(key);
+    const std::size_t slot_id = find_slot(key, hash);
+    if (hashes[slot_id] != 0) return false;
+    hashes[slot_id] = hash;
+    std::copy(key.begin(), key.begin() + n_words * 2, words.begin() + slot_id * n_words * 2);
+    n_entries++;
+    return true;
+  }
+
+  std::size_t count(const Det& det) const {
+    if (n_entries == 0 || get_n_words(det) > n_words) return 0;
+    Key key;
+    to_key(det, key);
+    return hashes[find_slot(key, get_hash(key))] == 0 ? 0 : 1;
+  }
+
+  template <std::size_t N>
+  std::size_t count(const BitDet<N>& det) const {
+    if (n_entries == 0) return 0;
+    const auto& up_words = det.up.get_words();
+    const auto& dn_words = det.dn.get_words();
+    Key key;
+    std::fill(key.begin(), key.begin() + n_words * 2, 0);
+    for (std::size_t k = 0; k < N; k++) {
+      if (k < n_words) {
+        key[k] = up_words[k];
+        key[n_words + k] = dn_words[k];
+      } else if (up_words[k] != 0 || dn_words[k] != 0) {
+        return 0;
+      }
+    }
+    return hashes[find_slot(key, get_hash(key))] == 0 ? 0 : 1;
+  }
+
+  // Make room for n dets without further rehashing.
+  void reserve(const std::size_t n) {
+    const std::size_t n_buckets = get_n_buckets_min(n);
+    if (n_buckets > bucket_count()) rehash(n_buckets, n_words);
+  }
+
+  std::size_t size() const { return n_entries; }
+
+  std::size_t bucket_count() const { return hashes.size(); }
+
+  // Remove all dets but keep the capacity and the width.
+  void clear() {
+    hashes.assign(hashes.size(), 0);
+    n_entries = 0;
+  }
+
+ private:
+  typedef std::array<std::uint64_t, BIT_DET_N_WORDS_MAX * 2> Key;  // Up words then dn words.
+
+  constexpr static double MAX_LOAD_FACTOR = 0.75;
+  constexpr static std::size_t MIN_BUCKETS = 16;
+
+  std::size_t n_words;
+  std::size_t n_entries;
+  std::size_t n_bits;  // log2 of the number of buckets.
+
+  // Hash of each slot, 0 if empty.
+  std::vector<std::uint64_t> hashes;
+
+  // Words of each slot, n_words * 2 per slot.
+  std::vector<std::uint64_t> words;
+
+  // Smallest power of two number of buckets holding n dets, and no fewer than the current ones.
+  std::size_t get_n_buckets_min(const std::size_t n) const {
+    std::size_t n_buckets = MIN_BUCKETS;
+    while (n > n_buckets * MAX_LOAD_FACTOR || n_buckets < bucket_count()) n_buckets *= 2;
+    return n_buckets;
+  }
+
+  static std::size_t get_n_words(const Det& det) {
+    const Orbitals& up_elecs = det.up.get_elec_orbs();
+    const Orbitals& dn_elecs = det.dn.get_elec_orbs();
+    std::size_t n_orbs = 0;
+    if (!up_elecs.empty()) n_orbs = up_elecs.back() + 1;
+    if (!dn_elecs.empty() && dn_elecs.back() >= n_orbs) n_orbs = dn_elecs.back() + 1;
+    return get_n_bit_det_words(n_orbs);
+  }
+
+  // Only the first n_words * 2 words of the key are used.
+  void to_key(const Det& det, Key& key) const {
+    std::fill(key.begin(), key.begin() + n_words * 2, 0);
+    for (const Orbital orb : det.up.get_elec_orbs()) {
+      key[orb >> 6] |= 1ULL << (orb & 63);
+    }
+    for (const Orbital orb : det.dn.get_elec_orbs()) {
+      key[n_words + (orb >> 6)] |= 1ULL << (orb & 63);
+    }
+  }
+
+  std::uint64_t get_hash(const Key& key) const {
+    std::uint64_t hash = 0;
+    for (std::size_t k = 0; k < n_words * 2; k++) {
+      hash = (hash ^ key[k]) * 0xFF51AFD7ED558CCDULL;
+      hash ^= hash >> 33;
+    }
+    return hash == 0 ? 1 : hash;
+  }
+
+  // Slot holding the key, or the empty slot where it would be inserted.
+  std::size_t find_slot(const Key& key, const std::uint64_t hash) const {
+    const std::size_t mask = hashes.size() - 1;
+    const std::size_t n_slot_words = n_words * 2;
+    std::size_t slot_id = static_cast<std::size_t>((hash * 0x9E3779B97F4A7C15ULL) >> (64 - n_bits));
+    while (hashes[slot_id] != 0) {
+      const auto& slot_words = words.begin() + slot_id * n_slot_words;
+      if (hashes[slot_id] == hash &&
+          std::equal(key.begin(), key.begin() + n_slot_words, slot_words)) {
+        break;
+      }
+      slot_id = (slot_id + 1) & mask;
+    }
+    return slot_id;
+  }
+
+  void rehash(const std::size_t n_buckets, const std::size_t n_words_new) {
+    std::vector<std::uint64_t> hashes_old;
+    std::vector<std::uint64_t> words_old;
+    hashes_old.swap(hashes);
+    words_old.swap(words);
+    const std::size_t n_words_old = n_words;
+    n_words = n_words_new;
+    hashes.assign(n_buckets, 0);
+    words.assign(n_buckets * n_words * 2, 0);
+    n_bits = 0;
+    while ((static_cast<std::size_t>(1) << n_bits) < n_buckets) n_bits++;
+    Key key;
+    for (std::size_t i = 0; i < hashes_old.size(); i++) {
+      if (hashes_old[i] == 0) continue;
+      const auto& slot_words = words_old.begin() + i * n_words_old * 2;
+      std::fill(key.begin(), key.begin() + n_words * 2, 0);
+      std::copy(slot_words, slot_words + n_words_old, key.begin());
+      std::copy(slot_words + n_words_old, slot_words + n_words_old * 2, key.begin() + n_words);
+      const std::uint64_t hash = n_words == n_words_old ? hashes_old[i] : get_hash(key);
+      const std::size_t slot_id = find_slot(key, hash);
+      hashes[slot_id] = hash;
+      std::copy(key.begin(), key.begin() + n_words * 2, words.begin() + slot_id * n_words * 2);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "det_set.h"
+#include "gtest/gtest.h"
+
+TEST(DetSetTest, InsertAndCount) {
+  DetSet det_set;
+  std::vector<Det> dets(100);
+  for (int i = 0; i < 100; i++) {
+    dets[i].up.set_orb(i % 10, true);
+    dets[i].up.set_orb(10, true);
+    dets[i].dn.set_orb(i / 10, true);
+  }
+  for (const auto& det : dets) EXPECT_TRUE(det_set.insert(det));
+  for (const auto& det : dets) EXPECT_FALSE(det_set.insert(det));
+  EXPECT_EQ(det_set.size(), 100);
+  EXPECT_EQ(det_set.count(dets[42]), 1);
+  EXPECT_EQ(det_set.count(BitDet<2>(dets[42])), 1);
+  Det det_new = dets[42];
+  det_new.dn.set_orb(11, true);
+  EXPECT_EQ(det_set.count(det_new), 0);
+  EXPECT_EQ(det_set.count(BitDet<1>(det_new)), 0);
+  det_set.clear();
+  EXPECT_EQ(det_set.size(), 0);
+  EXPECT_EQ(det_set.count(dets[42]), 0);
+}
+
+TEST(DetSetTest, WidenForHighOrbitals) {
+  DetSet det_set;
+  Det det_low, det_high;
+  det_low.up.set_orb(3, true);
+  det_low.dn.set_orb(5, true);
+  det_high.up.set_orb(3, true);
+  det_high.dn.set_orb(130, true);
+  EXPECT_TRUE(det_set.insert(det_low));
+  EXPECT_EQ(det_set.count(det_high), 0);
+  EXPECT_EQ(det_set.count(BitDet<3>(det_high)), 0);
+  EXPECT_TRUE(det_set.insert(det_high));
+  EXPECT_EQ(det_set.count(det_low), 1);
+  EXPECT_EQ(det_set.count(BitDet<1>(det_low)), 1);
+  EXPECT_EQ(det_set.count(BitDet<3>(det_high)), 1);
+}
@@ -0,0 +1,151 @@
+#ifndef HCI_EXCITATION_H_
+#define HCI_EXCITATION_H_
+
+#include "../std.h"
+
+#include "../types.h"
+#include "bit_det.h"
+#include "det.h"
+
+// Holes, particles and fermion sign taking lhs to rhs, resolved up to double excitations.
+// Analysis stops as soon as more than two electrons are found to differ.
+class Excitation {
+ public:
+  std::size_t n_up;  // Number of excited up electrons.
+  std::size_t n_dn;  // Number of excited dn electrons.
+  std::array<Orbital, 2> holes;  // Occupied in lhs only. Up holes first, ascending.
+  std::array<Orbital, 2> particles;  // Occupied in rhs only. Up particles first, ascending.
+  int sign;
+
+  Excitation() : n_up(0), n_dn(0), sign(1) {}
+
+  std::size_t get_degree() const { return n_up + n_dn; }
+
+  // Move the electrons of det from the holes to the particles.
+  void apply_to(Det& det) const {
+    for (std::size_t i = 0; i < n_up; i++) det.up.set_orb(holes[i], false);
+    for (std::size_t i = 0; i < n_up; i++) det.up.set_orb(particles[i], true);
+    for (std::size_t i = n_up; i < n_up + n_dn; i++) det.dn.set_orb(holes[i], false);
+    for (std::size_t i = n_up; i < n_up + n_dn; i++) det.dn.set_orb(particles[i], true);
+  }
+
+  template <std::size_t N>
+  void apply_to(BitDet<N>& det) const {
+    for (std::size_t i = 0; i < n_up; i++) det.up.set_orb(holes[i], false);
+    for (std::size_t i = 0; i < n_up; i++) det.up.set_orb(particles[i], true);
+    for (std::size_t i = n_up; i < n_up + n_dn; i++) det.dn.set_orb(holes[i], false);
+    for (std::size_t i = n_up; i < n_up + n_dn; i++) det.dn.set_orb(particles[i], true);
+  }
+
+  void from_dets(const Det& lhs, const Det& rhs) {
+    int gamma_exp = 0;
+    n_dn = 0;
+    n_up = from_spin_dets(lhs.up, rhs.up, 0, gamma_exp);
+    if (n_up > 2) return;
+    n_dn = from_spin_dets(lhs.dn, rhs.dn, n_up, gamma_exp);
+    if (n_up + n_dn > 2) return;
+    sign = (gamma_exp & 1) ? -1 : 1;
+  }
+
+  // Double excitation of lhs whose holes and particles are known, the first n_up of each up and
+  // the others dn, as ids within their spin. The sign only needs the electrons of lhs below them.
+  void from_orbs(
+      const Det& lhs,
+      const std::size_t n_up,
+      const std::array<Orbital, 2>& holes,
+      const std::array<Orbital, 2>& particles) {
+    this->n_up = n_up;
+    n_dn = 2 - n_up;
+    this->holes = holes;
+    this->particles = particles;
+    if (n_up != 1) {
+      if (this->holes[0] > this->holes[1]) std::swap(this->holes[0], this->holes[1]);
+      if (this->particles[0] > this->particles[1]) {
+        std::swap(this->particles[0], this->particles[1]);
+      }
+    }
+    int gamma_exp = 0;
+    for (std::size_t i = 0; i < 2; i++) {
+      const bool is_up = i < n_up;
+      const auto& elecs = is_up ? lhs.up.get_elec_orbs() : lhs.dn.get_elec_orbs();
+      const Orbital hole = this->holes[i];
+      const Orbital particle = this->particles[i];
+      gamma_exp += std::lower_bound(elecs.begin(), elecs.end(), hole) - elecs.begin();
+
+      // Below the particle in rhs, where the holes of this spin are gone and its particles added.
+      gamma_exp += std::lower_bound(elecs.begin(), elecs.end(), particle) - elecs.begin();
+      for (std::size_t j = is_up ? 0 : n_up; j < (is_up ? n_up : 2); j++) {
+        if (this->holes[j] < particle) gamma_exp--;
+        if (this->particles[j] < particle) gamma_exp++;
+      }
+    }
+    sign = (gamma_exp & 1) ? -1 : 1;
+  }
+
+  template <std::size_t N>
+  void from_dets(const BitDet<N>& lhs, const BitDet<N>& rhs) {
+    n_up = lhs.up.get_n_diffs(rhs.up);
+    n_dn = lhs.dn.get_n_diffs(rhs.dn);
+    if (n_up + n_dn > 2) return;
+    int gamma_exp = 0;
+    from_spin_dets(lhs.up, rhs.up, 0, gamma_exp);
+    from_spin_dets(lhs.dn, rhs.dn, n_up, gamma_exp);
+    sign = (gamma_exp & 1) ? -1 : 1;
+  }
+
+ private:
+  // The parity exponent adds up the position of each differing orbital in its own det.
+  // Returns the number of excited electrons of this spin, or 3 once past a double excitation.
+  std::size_t from_spin_dets(
+      const SpinDet& lhs, const SpinDet& rhs, const std::size_t offset, int& gamma_exp) {
+    const auto& lhs_elecs = lhs.get_elec_orbs();
+    const auto& rhs_elecs = rhs.get_elec_orbs();
+    const std::size_t lhs_size = lhs_elecs.size();
+    const std::size_t rhs_size = rhs_elecs.size();
+    std::size_t lhs_ptr = 0;
+    std::size_t rhs_ptr = 0;
+    std::size_t n_holes = offset;
+    std::size_t n_particles = offset;
+    while (lhs_ptr < lhs_size || rhs_ptr < rhs_size) {
+      if (rhs_ptr == rhs_size || (lhs_ptr < lhs_size && lhs_elecs[lhs_ptr] < rhs_elecs[rhs_ptr])) {
+        if (n_holes == 2) return 3;
+        holes[n_holes++] = lhs_elecs[lhs_ptr];
+        gamma_exp += lhs_ptr;
+        lhs_ptr++;
+      } else if (lhs_ptr == lhs_size || lhs_elecs[lhs_ptr] > rhs_elecs[rhs_ptr]) {
+        if (n_particles == 2) return 3;
+        particles[n_particles++] = rhs_elecs[rhs_ptr];
+        gamma_exp += rhs_ptr;
+        rhs_ptr++;
+      } else {
+        lhs_ptr++;
+        rhs_ptr++;
+      }
+    }
+    return n_holes - offset;
+  }
+
+  template <std::size_t N>
+  std::size_t from_spin_dets(
+      const BitSpinDet<N>& lhs, const BitSpinDet<N>& rhs, const std::size_t offset, int& gamma_exp) {
+    BitSpinDet<N> eor;
+    eor.from_eor(lhs, rhs);
+    Orbital eor_orbs[4];
+    const std::size_t n_eor = eor.get_elec_orbs(eor_orbs, 4);
+    std::size_t n_holes = offset;
+    std::size_t n_particles = offset;
+    for (std::size_t i = 0; i < n_eor; i++) {
+      const Orbital orb_id = eor_orbs[i];
+      if (lhs.get_orb(orb_id)) {
+        holes[n_holes++] = orb_id;
+        gamma_exp += lhs.get_n_elecs_below(orb_id);
+      } else {
+        particles[n_particles++] = orb_id;
+        gamma_exp += rhs.get_n_elecs_below(orb_id);
+      }
+    }
+    return n_holes - offset;
+  }
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "excitation.h"
+#include "gtest/gtest.h"
+
+TEST(ExcitationTest, OppositeSpinDoubleExcitation) {
+  Det det1, det2;
+  det1.up.set_orb(0, true);
+  det1.up.set_orb(1, true);
+  det1.dn.set_orb(0, true);
+  det1.dn.set_orb(1, true);
+  det2.up.set_orb(1, true);
+  det2.up.set_orb(2, true);
+  det2.dn.set_orb(0, true);
+  det2.dn.set_orb(3, true);
+  Excitation excitation;
+  excitation.from_dets(det1, det2);
+  EXPECT_EQ(excitation.get_degree(), 2);
+  EXPECT_EQ(excitation.n_up, 1);
+  EXPECT_EQ(excitation.n_dn, 1);
+  EXPECT_EQ(excitation.holes[0], 0);
+  EXPECT_EQ(excitation.holes[1], 1);
+  EXPECT_EQ(excitation.particles[0], 2);
+  EXPECT_EQ(excitation.particles[1], 3);
+  EXPECT_EQ(excitation.sign, -1);
+  Det det3 = det1;
+  excitation.apply_to(det3);
+  EXPECT_TRUE(det3 == det2);
+
+  Excitation bit_excitation;
+  bit_excitation.from_dets(BitDet<1>(det1), BitDet<1>(det2));
+  EXPECT_EQ(bit_excitation.get_degree(), 2);
+  EXPECT_EQ(bit_excitation.holes, excitation.holes);
+  EXPECT_EQ(bit_excitation.particles, excitation.particles);
+  EXPECT_EQ(bit_excitation.sign, excitation.sign);
+}
+
+TEST(ExcitationTest, EarlyExitBeyondDoubleExcitation) {
+  Det det1, det2;
+  for (int i = 0; i < 3; i++) det1.up.set_orb(i, true);
+  for (int i = 3; i < 6; i++) det2.up.set_orb(i, true);
+  Excitation excitation;
+  excitation.from_dets(det1, det2);
+  EXPECT_GT(excitation.get_degree(), 2);
+  excitation.from_dets(BitDet<1>(det1), BitDet<1>(det2));
+  EXPECT_GT(excitation.get_degree(), 2);
+}
+
+TEST(ExcitationTest, WideBitDetExcitation) {
+  Det det1, det2;
+  det1.up.set_orb(0, true);
+  det1.up.set_orb(1700, true);
+  det1.dn.set_orb(2, true);
+  det2.up.set_orb(5, true);
+  det2.up.set_orb(1750, true);
+  det2.dn.set_orb(2, true);
+  Excitation excitation;
+  excitation.from_dets(det1, det2);
+  Excitation bit_excitation;
+  bit_excitation.from_dets(BitDet<BIT_DET_N_WORDS_MAX>(det1), BitDet<BIT_DET_N_WORDS_MAX>(det2));
+  EXPECT_EQ(bit_excitation.n_up, 2);
+  EXPECT_EQ(bit_excitation.holes, excitation.holes);
+  EXPECT_EQ(bit_excitation.particles, excitation.particles);
+  EXPECT_EQ(bit_excitation.sign, excitation.sign);
+}
+
+TEST(ExcitationTest, FromOrbsMatchesFromDets) {
+  Det det;
+  for (const Orbital orb : {1, 3, 4, 7}) det.up.set_orb(orb, true);
+  for (const Orbital orb : {0, 2, 5}) det.dn.set_orb(orb, true);
+  const std::array<std::size_t, 3> n_ups({{2, 1, 0}});
+  const std::array<std::array<Orbital, 2>, 3> holes({{{{7, 1}}, {{3, 5}}, {{5, 0}}}});
+  const std::array<std::array<Orbital, 2>, 3> particles({{{{2, 9}}, {{8, 1}}, {{6, 3}}}});
+  for (std::size_t k = 0; k < 3; k++) {
+    Excitation excitation;
+    excitation.from_orbs(det, n_ups[k], holes[k], particles[k]);
+    Det det_a = det;
+    excitation.apply_to(det_a);
+    Excitation expected;
+    expected.from_dets(det, det_a);
+    EXPECT_EQ(excitation.n_up, expected.n_up);
+    EXPECT_EQ(excitation.n_dn, expected.n_dn);
+    EXPECT_EQ(excitation.holes, expected.holes);
+    EXPECT_EQ(excitation.particles, expected.particles);
+    EXPECT_EQ(excitation.sign, expected.sign);
+  }
+}
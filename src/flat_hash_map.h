@@ -0,0 +1,156 @@
+#ifndef HCI_FLAT_HASH_MAP_H_
+#define HCI_FLAT_HASH_MAP_H_
+
+#include "std.h"
+
+// Open addressing hash map with linear probing for small trivially copyable keys and values.
+// Entries live inline in one contiguous array, so there are no per-entry allocations or
+// bucket pointers. Erasing single entries is not supported.
+template <class K, class V, class H>
+class FlatHashMap {
+ public:
+  typedef std::pair<K, V> value_type;
+
+  class const_iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef std::pair<K, V> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const value_type* pointer;
+    typedef const value_type& reference;
+
+    const_iterator(const FlatHashMap* map, const std::size_t slot_id) : map(map), slot_id(slot_id) {
+      skip_empty();
+    }
+
+    reference operator*() const { return map->slots[slot_id]; }
+
+    pointer operator->() const { return &map->slots[slot_id]; }
+
+    const_iterator& operator++() {
+      slot_id++;
+      skip_empty();
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator it = *this;
+      ++(*this);
+      return it;
+    }
+
+    bool operator==(const const_iterator& rhs) const { return slot_id == rhs.slot_id; }
+
+    bool operator!=(const const_iterator& rhs) const { return slot_id != rhs.slot_id; }
+
+   private:
+    const FlatHashMap* map;
+    std::size_t slot_id;
+
+    void skip_empty() {
+      while (slot_id < map->slots.size() && !map->filled[slot_id]) slot_id++;
+    }
+  };
+
+  FlatHashMap() : n_entries(0), n_bits(0) {}
+
+  V& operator[](const K& key) {
+    if ((n_entries + 1) > bucket_count() * MAX_LOAD_FACTOR) {
+      rehash(std::max(bucket_count() * 2, MIN_BUCKETS));
+    }
+    const std::size_t slot_id = find_slot(key);
+    if (!filled[slot_id]) {
+      filled[slot_id] = true;
+      slots[slot_id].first = key;
+      slots[slot_id].second = V();
+      n_entries++;
+    }
+    return slots[slot_id].second;
+  }
+
+  std::size_t count(const K& key) const {
+    if (n_entries == 0) return 0;
+    return filled[find_slot(key)] ? 1 : 0;
+  }
+
+  const V& at(const K& key) const {
+    const std::size_t slot_id = n_entries == 0 ? 0 : find_slot(key);
+    if (n_entries == 0 || !filled[slot_id]) throw std::out_of_range("Key not found.");
+    return slots[slot_id].second;
+  }
+
+  // Make room for n entries without further rehashing.
+  void reserve(const std::size_t n) {
+    std::size_t n_buckets = MIN_BUCKETS;
+    while (n > n_buckets * MAX_LOAD_FACTOR) n_buckets *= 2;
+    if (n_buckets > bucket_count()) rehash(n_buckets);
+  }
+
+  std::size_t size() const { return n_entries; }
+
+  bool empty() const { return n_entries == 0; }
+
+  std::size_t bucket_count() const { return slots.size(); }
+
+  double load_factor() const { return slots.empty() ? 0.0 : n_entries * 1.0 / slots.size(); }
+
+  // Remove all entries but keep the capacity.
+  void clear() {
+    filled.assign(filled.size(), false);
+    n_entries = 0;
+  }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+
+  const_iterator end() const { return const_iterator(this, slots.size()); }
+
+ private:
+  constexpr static double MAX_LOAD_FACTOR = 0.75;
+  constexpr static std::size_t MIN_BUCKETS = 16;
+
+  std::vector<value_type> slots;
+  std::vector<bool> filled;
+  std::size_t n_entries;
+  std::size_t n_bits;  // log2 of the number of buckets.
+  H hasher;
+
+  // Fibonacci hashing takes the high bits, which stay well mixed even if the low bits of
+  // the hash are correlated, e.g. after distributing keys by hash modulo the process count.
+  std::size_t get_home_slot(const K& key) const {
+    const std::uint64_t hash = static_cast<std::uint64_t>(hasher(key)) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<std::size_t>(hash >> (64 - n_bits));
+  }
+
+  // Slot holding the key, or the empty slot where it would be inserted.
+  std::size_t find_slot(const K& key) const {
+    const std::size_t mask = slots.size() - 1;
+    std::size_t slot_id = get_home_slot(key);
+    while (filled[slot_id] && !(slots[slot_id].first == key)) slot_id = (slot_id + 1) & mask;
+    return slot_id;
+  }
+
+  void rehash(const std::size_t n_buckets) {
+    std::vector<value_type> slots_old;
+    std::vector<bool> filled_old;
+    slots_old.swap(slots);
+    filled_old.swap(filled);
+    slots.resize(n_buckets);
+    filled.assign(n_buckets, false);
+    n_bits = 0;
+    while ((static_cast<std::size_t>(1) << n_bits) < n_buckets) n_bits++;
+    for (std::size_t i = 0; i < slots_old.size(); i++) {
+      if (!filled_old[i]) continue;
+      const std::size_t slot_id = find_slot(slots_old[i].first);
+      filled[slot_id] = true;
+      slots[slot_id] = slots_old[i];
+    }
+  }
+};
+
+template <class K, class V, class H>
+constexpr double FlatHashMap<K, V, H>::MAX_LOAD_FACTOR;
+
+template <class K, class V, class H>
+constexpr std::size_t FlatHashMap<K, V, H>::MIN_BUCKETS;
+
+#endif
@@ -0,0 +1,27 @@
+#include "flat_hash_map.h"
+#include "gtest/gtest.h"
+
+TEST(FlatHashMapTest, IncrementAndIterate) {
+  FlatHashMap<int, double, std::hash<int>> map;
+  for (int i = 0; i < 1000; i++) map[i % 100] += 1.0;
+  EXPECT_EQ(map.size(), 100);
+  EXPECT_EQ(map.count(5), 1);
+  EXPECT_EQ(map.count(100), 0);
+  EXPECT_DOUBLE_EQ(map.at(5), 10.0);
+  EXPECT_LE(map.load_factor(), 0.75);
+  double sum = 0.0;
+  for (const auto& kv : map) sum += kv.second;
+  EXPECT_DOUBLE_EQ(sum, 1000.0);
+  map.clear();
+  EXPECT_EQ(map.size(), 0);
+  EXPECT_EQ(map.count(5), 0);
+}
+
+TEST(FlatHashMapTest, Reserve) {
+  FlatHashMap<int, double, std::hash<int>> map;
+  map.reserve(1000);
+  const std::size_t n_buckets = map.bucket_count();
+  for (int i = 0; i < 1000; i++) map[i] = i;
+  EXPECT_EQ(map.bucket_count(), n_buckets);
+  EXPECT_DOUBLE_EQ(map.at(999), 999.0);
+}
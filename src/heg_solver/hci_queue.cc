@@ -0,0 +1,42 @@
+#include "hci_queue.h"
+
+HCIQueue::HCIQueue(
+    const std::vector<TinyInt3>& keys,
+    const std::vector<UnsignedInt>& n_items,
+    const std::vector<TinyInt>& item_diffs,
+    const std::vector<double>& item_abs_Hs,
+    const double H_unit) {
+  assert(keys.size() == n_items.size());
+  int n_max = 0;
+  for (const auto& key : keys) {
+    for (const TinyInt k : key) n_max = std::max(n_max, abs(static_cast<int>(k)));
+  }
+  offset = n_max;
+  length = n_max * 2 + 1;
+  const std::size_t n_cells = length * length * length;
+
+  // Count the items of each cell, then place the ranges in the order of the cells.
+  std::vector<std::size_t> cells(keys.size());
+  std::vector<std::size_t> item_begins(keys.size());
+  range_offsets.assign(n_cells + 1, 0);
+  std::size_t n_items_total = 0;
+  for (std::size_t i = 0; i < keys.size(); i++) {
+    const auto& key = keys[i];
+    cells[i] = ((key[0] + offset) * length + key[1] + offset) * length + key[2] + offset;
+    item_begins[i] = n_items_total;
+    n_items_total += n_items[i];
+    range_offsets[cells[i] + 1] = n_items[i];
+  }
+  for (std::size_t cell = 0; cell < n_cells; cell++) range_offsets[cell + 1] += range_offsets[cell];
+  diffs.resize(n_items_total);
+  abs_Hs.resize(n_items_total);
+  max_abs_H = 0.0;
+  for (std::size_t i = 0; i < keys.size(); i++) {
+    std::size_t pos = range_offsets[cells[i]];
+    for (std::size_t k = item_begins[i]; k < item_begins[i] + n_items[i]; k++, pos++) {
+      diffs[pos] = {item_diffs[k * 3], item_diffs[k * 3 + 1], item_diffs[k * 3 + 2]};
+      abs_Hs[pos] = item_abs_Hs[k] * H_unit;
+    }
+    if (n_items[i] > 0) max_abs_H = std::max(max_abs_H, abs_Hs[range_offsets[cells[i]]]);
+  }
+}
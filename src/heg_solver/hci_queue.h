@@ -0,0 +1,57 @@
+#ifndef HCI_HCI_QUEUE_H_
+#define HCI_HCI_QUEUE_H_
+
+#include "../std.h"
+
+#include "../types.h"
+
+// HCI queues of all the keys flattened into one array of diffs and one of |H|, with the items
+// of each key in a contiguous range sorted by decreasing |H|. Keys are looked up in a dense
+// table of range offsets over the cube of keys, e.g. the diff_pq of the same spin excitations.
+class HCIQueue {
+ public:
+  HCIQueue() : offset(0), length(0), max_abs_H(0.0) {}
+
+  // The items of keys[i] are the next n_items[i] items, each item being three components of
+  // item_diffs and one abs_H scaled by H_unit.
+  HCIQueue(
+      const std::vector<TinyInt3>& keys,
+      const std::vector<UnsignedInt>& n_items,
+      const std::vector<TinyInt>& item_diffs,
+      const std::vector<double>& item_abs_Hs,
+      const double H_unit);
+
+  // Range of the items of key in get_diffs() and get_abs_Hs(), empty if it has none.
+  std::size_t begin(const TinyInt3& key) const { return get_range(key, 0); }
+
+  std::size_t end(const TinyInt3& key) const { return get_range(key, 1); }
+
+  const TinyInt3* get_diffs() const { return diffs.data(); }
+
+  const double* get_abs_Hs() const { return abs_Hs.data(); }
+
+  bool empty() const { return abs_Hs.empty(); }
+
+  double get_max_abs_H() const { return max_abs_H; }
+
+ private:
+  int offset;
+  int length;
+  double max_abs_H;
+
+  // Offsets of the range of each key in the cube, length^3 + 1.
+  std::vector<UnsignedInt> range_offsets;
+
+  std::vector<TinyInt3> diffs;
+  std::vector<double> abs_Hs;
+
+  std::size_t get_range(const TinyInt3& key, const std::size_t end) const {
+    const int x = key[0] + offset;
+    const int y = key[1] + offset;
+    const int z = key[2] + offset;
+    if (x < 0 || x >= length || y < 0 || y >= length || z < 0 || z >= length) return 0;
+    return range_offsets[(x * length + y) * length + z + end];
+  }
+};
+
+#endif
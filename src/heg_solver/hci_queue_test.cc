@@ -0,0 +1,22 @@
+#include "hci_queue.h"
+#include "gtest/gtest.h"
+
+TEST(HCIQueueTest, FindRanges) {
+  const std::vector<TinyInt3> keys = {{1, 0, 0}, {0, -2, 1}, {0, 0, 1}};
+  const std::vector<UnsignedInt> n_items = {2, 0, 1};
+  const std::vector<TinyInt> item_diffs = {1, 1, 0, 0, 1, 0, -1, 0, 0};
+  const std::vector<double> item_abs_Hs = {2.0, 1.0, 4.0};
+  const HCIQueue queue(keys, n_items, item_diffs, item_abs_Hs, 0.5);
+  EXPECT_DOUBLE_EQ(queue.get_max_abs_H(), 2.0);
+
+  const TinyInt3 key = {1, 0, 0};
+  ASSERT_EQ(queue.end(key) - queue.begin(key), 2);
+  EXPECT_DOUBLE_EQ(queue.get_abs_Hs()[queue.begin(key)], 1.0);
+  EXPECT_DOUBLE_EQ(queue.get_abs_Hs()[queue.begin(key) + 1], 0.5);
+  EXPECT_EQ(queue.get_diffs()[queue.begin(key) + 1], TinyInt3({0, 1, 0}));
+
+  const TinyInt3 key_empty = {0, -2, 1};
+  EXPECT_EQ(queue.begin(key_empty), queue.end(key_empty));
+  const TinyInt3 key_outside = {5, 0, 0};
+  EXPECT_EQ(queue.begin(key_outside), queue.end(key_outside));
+}
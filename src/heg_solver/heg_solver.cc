@@ -6,15 +6,22 @@
 #include "../array_math.h"
 #include "../big_unordered_map.h"
 #include "../config.h"
+#include "../det/bit_det.h"
+#include "../det/excitation.h"
 #include "../parallel.h"
 #include "../regression/linear_regression.h"
 #include "../time/time.h"
+#include "hci_queue.h"
 #include "k_points_util.h"
 
 void HEGSolver::solve() {
   printf("Proc %d running on %s\n", Parallel::get_id(), Parallel::get_host().c_str());
   n_up = Config::get<std::size_t>("n_up");
   n_dn = Config::get<std::size_t>("n_dn");
+  spin_flip_symmetry = Config::get<bool>("spin_flip_symmetry", false);
+  if (spin_flip_symmetry && n_up != n_dn) {
+    throw std::invalid_argument("spin_flip_symmetry requires n_up == n_dn.");
+  }
   rcut_vars = Config::get_array<double>("rcut_vars");
   eps_vars = Config::get_array<double>("eps_vars");
   rcut_pts = Config::get_array<double>("rcut_pts");
@@ -25,6 +32,8 @@ void HEGSolver::solve() {
   std::sort(eps_pts.begin(), eps_pts.end());
   std::reverse(eps_vars.begin(), eps_vars.end());
   std::reverse(eps_pts.begin(), eps_pts.end());
+  const double rcut_max = std::max(rcut_vars.back(), rcut_pts.back());
+  n_words = get_bit_det_width(get_n_bit_det_words(KPointsUtil::get_n_k_points(rcut_max)));
 
   Time::start("variation stage");
   for (const double rcut_var : rcut_vars) {
@@ -94,15 +103,77 @@ void HEGSolver::setup() {
 }
 
 void HEGSolver::generate_hci_queue(const double rcut) {
-  same_spin_hci_queue.clear();
-  opposite_spin_hci_queue.clear();
-  max_abs_H = 0.0;
+  // The queues only depend on rcut within a run, so PT builds them once for all the variational
+  // wavefunctions.
+  if (!same_spin_hci_queue.empty() && rcut == hci_queue_rcut) return;
+  hci_queue_rcut = rcut;
 
   // Common dependencies.
   const auto& k_diffs = KPointsUtil::get_k_diffs(k_points);
 
-  // Same spin.
+  // Same spin, in units of H_unit, only for the diff_pq that are canonical under the cubic
+  // symmetry of the k points. The queue of any other diff_pq is that of its canonical image,
+  // with the diff_pr transformed back, see find_connected_excitations.
+  std::vector<TinyInt3> diff_pqs;
   for (const auto& diff_pq : k_diffs) {
+    if (CubicSymmetry(diff_pq).get_canonical() == diff_pq) diff_pqs.push_back(diff_pq);
+  }
+  const std::size_t n_diffs = diff_pqs.size();
+  std::vector<UnsignedInt> n_items;
+  std::vector<TinyInt> item_diffs;
+  std::vector<double> item_abs_Hs;
+  const bool is_saved = Config::get<bool>("save_hci_queue", false);
+  const std::string filename = str(boost::format("hci_queue_%.3e.dat") % rcut);
+  if (!is_saved || !load_hci_queue(filename, n_diffs, n_items, item_diffs, item_abs_Hs)) {
+    generate_same_spin_hci_queue(rcut, diff_pqs, k_diffs, n_items, item_diffs, item_abs_Hs);
+    if (is_saved) save_hci_queue(filename, n_items, item_diffs, item_abs_Hs);
+  }
+  same_spin_hci_queue = HCIQueue(diff_pqs, n_items, item_diffs, item_abs_Hs, H_unit);
+
+  // Opposite spin, independent of diff_pq and kept under the zero key.
+  std::vector<TinyInt3Double> items;
+  for (const auto& diff_pr : k_diffs) {
+    const double abs_H = 1.0 / sum(square(diff_pr));
+    if (abs_H < DBL_EPSILON) continue;
+    items.push_back(TinyInt3Double(cast<TinyInt>(diff_pr), abs_H));
+  }
+  std::stable_sort(
+      items.begin(), items.end(), [](const TinyInt3Double& a, const TinyInt3Double& b) -> bool {
+        return a.second > b.second;
+      });
+  item_diffs.clear();
+  item_abs_Hs.clear();
+  for (const auto& item : items) {
+    item_diffs.insert(item_diffs.end(), item.first.begin(), item.first.end());
+    item_abs_Hs.push_back(item.second);
+  }
+  opposite_spin_hci_queue = HCIQueue(
+      std::vector<TinyInt3>(1, TinyInt3({0, 0, 0})),
+      std::vector<UnsignedInt>(1, static_cast<UnsignedInt>(items.size())),
+      item_diffs,
+      item_abs_Hs,
+      H_unit);
+  max_abs_H =
+      std::max(same_spin_hci_queue.get_max_abs_H(), opposite_spin_hci_queue.get_max_abs_H());
+}
+
+void HEGSolver::generate_same_spin_hci_queue(
+    const double rcut,
+    const std::vector<TinyInt3>& diff_pqs,
+    const std::vector<TinyInt3>& k_diffs,
+    std::vector<UnsignedInt>& n_items,
+    std::vector<TinyInt>& item_diffs,
+    std::vector<double>& item_abs_Hs) {
+  const std::size_t n_diffs = diff_pqs.size();
+  const std::size_t proc_id = Parallel::get_id();
+  const std::size_t n_procs = Parallel::get_n();
+
+  // The diff_pq are striped to the processes and dealt to the threads.
+  std::vector<std::vector<TinyInt3Double>> items_pq(n_diffs);
+#pragma omp parallel for schedule(dynamic, 4)
+  for (std::size_t i = proc_id; i < n_diffs; i += n_procs) {
+    const auto& diff_pq = diff_pqs[i];
+    auto& items = items_pq[i];
     for (const auto& diff_pr : k_diffs) {
       const auto& diff_sr = diff_pr + diff_pr - diff_pq;  // Momentum conservation.
       if (diff_sr == 0 || norm(diff_sr) > rcut * 2) continue;
@@ -111,31 +182,126 @@ void HEGSolver::generate_hci_queue(const double rcut) {
       if (sum(square(diff_pr)) == sum(square(diff_ps))) continue;
       const double abs_H = fabs(1.0 / sum(square(diff_pr)) - 1.0 / sum(square(diff_ps)));
       if (abs_H < DBL_EPSILON) continue;
-      const auto& item = TinyInt3Double(cast<TinyInt>(diff_pr), abs_H * H_unit);
-      same_spin_hci_queue[cast<TinyInt>(diff_pq)].push_back(item);
+      items.push_back(TinyInt3Double(cast<TinyInt>(diff_pr), abs_H));
     }
-  }
-  for (auto& kv : same_spin_hci_queue) {
-    auto& items = kv.second;
     std::stable_sort(
         items.begin(), items.end(), [](const TinyInt3Double& a, const TinyInt3Double& b) -> bool {
           return a.second > b.second;
         });
-    max_abs_H = std::max(max_abs_H, items.front().second);
   }
 
-  // Opposite spin.
-  for (const auto& diff_pr : k_diffs) {
-    const double abs_H = 1.0 / sum(square(diff_pr));
-    if (abs_H < DBL_EPSILON) continue;
-    const auto& item = TinyInt3Double(cast<TinyInt>(diff_pr), abs_H * H_unit);
-    opposite_spin_hci_queue.push_back(item);
+  // Flatten the local queues and gather them on all the processes.
+  std::vector<UnsignedInt> n_items_local;
+  std::vector<TinyInt> item_diffs_local;
+  std::vector<double> item_abs_Hs_local;
+  for (std::size_t i = proc_id; i < n_diffs; i += n_procs) {
+    n_items_local.push_back(static_cast<UnsignedInt>(items_pq[i].size()));
+    for (const auto& item : items_pq[i]) {
+      item_diffs_local.insert(item_diffs_local.end(), item.first.begin(), item.first.end());
+      item_abs_Hs_local.push_back(item.second);
+    }
+    std::vector<TinyInt3Double>().swap(items_pq[i]);
+  }
+  std::vector<std::vector<UnsignedInt>> n_items_procs;
+  std::vector<std::vector<TinyInt>> item_diffs_procs;
+  std::vector<std::vector<double>> item_abs_Hs_procs;
+  Parallel::all_gather(n_items_local, n_items_procs);
+  Parallel::all_gather(item_diffs_local, item_diffs_procs);
+  Parallel::all_gather(item_abs_Hs_local, item_abs_Hs_procs);
+
+  // Back to the order of diff_pqs.
+  n_items.assign(n_diffs, 0);
+  item_diffs.clear();
+  item_abs_Hs.clear();
+  std::vector<std::size_t> item_begins(n_procs, 0);
+  for (std::size_t i = 0; i < n_diffs; i++) {
+    const std::size_t p = i % n_procs;
+    const UnsignedInt n_items_i = n_items_procs[p][i / n_procs];
+    const std::size_t begin = item_begins[p];
+    const std::size_t end = begin + n_items_i;
+    n_items[i] = n_items_i;
+    item_diffs.insert(
+        item_diffs.end(),
+        item_diffs_procs[p].begin() + begin * 3,
+        item_diffs_procs[p].begin() + end * 3);
+    item_abs_Hs.insert(
+        item_abs_Hs.end(),
+        item_abs_Hs_procs[p].begin() + begin,
+        item_abs_Hs_procs[p].begin() + end);
+    item_begins[p] = end;
   }
-  std::stable_sort(
-      opposite_spin_hci_queue.begin(),
-      opposite_spin_hci_queue.end(),
-      [](const TinyInt3Double& a, const TinyInt3Double& b) -> bool { return a.second > b.second; });
-  max_abs_H = std::max(max_abs_H, opposite_spin_hci_queue.front().second);
+}
+
+// Leading words of the HCI queue files, for the layout below.
+const BigUnsignedInt HCI_QUEUE_MAGIC = 0x4555455551494348ULL;  // "HCIQUEUE".
+const BigUnsignedInt HCI_QUEUE_VERSION = 1;
+
+void HEGSolver::save_hci_queue(
+    const std::string& filename,
+    const std::vector<UnsignedInt>& n_items,
+    const std::vector<TinyInt>& item_diffs,
+    const std::vector<double>& item_abs_Hs) {
+  if (Parallel::get_id() != 0) return;
+  std::ofstream queue_file(filename, std::ios::binary);
+  const BigUnsignedInt n_diffs = n_items.size();
+  queue_file.write(reinterpret_cast<const char*>(&HCI_QUEUE_MAGIC), sizeof(HCI_QUEUE_MAGIC));
+  queue_file.write(reinterpret_cast<const char*>(&HCI_QUEUE_VERSION), sizeof(HCI_QUEUE_VERSION));
+  queue_file.write(reinterpret_cast<const char*>(&n_diffs), sizeof(n_diffs));
+  queue_file.write(reinterpret_cast<const char*>(n_items.data()), n_diffs * sizeof(UnsignedInt));
+  queue_file.write(reinterpret_cast<const char*>(item_diffs.data()), item_diffs.size());
+  queue_file.write(
+      reinterpret_cast<const char*>(item_abs_Hs.data()), item_abs_Hs.size() * sizeof(double));
+  queue_file.close();
+  printf("HCI queue saved to: %s\n", filename.c_str());
+}
+
+// False if the file does not exist, is not a complete queue file of this version, or is for
+// another set of k points.
+static bool read_hci_queue(
+    const std::string& filename,
+    const std::size_t n_diffs,
+    std::vector<UnsignedInt>& n_items,
+    std::vector<TinyInt>& item_diffs,
+    std::vector<double>& item_abs_Hs) {
+  std::ifstream queue_file(filename, std::ios::binary | std::ios::ate);
+  if (!queue_file.is_open()) return false;  // Does not exist.
+  const BigUnsignedInt file_size = static_cast<BigUnsignedInt>(queue_file.tellg());
+  queue_file.seekg(0);
+  BigUnsignedInt header[3] = {0, 0, 0};  // Magic, version and n_diffs.
+  queue_file.read(reinterpret_cast<char*>(header), sizeof(header));
+  if (!queue_file || header[0] != HCI_QUEUE_MAGIC || header[1] != HCI_QUEUE_VERSION) return false;
+  if (header[2] != n_diffs) return false;  // From other k points.
+  const BigUnsignedInt n_items_offset = sizeof(header) + n_diffs * sizeof(UnsignedInt);
+  if (file_size < n_items_offset) return false;
+  n_items.resize(n_diffs);
+  queue_file.read(reinterpret_cast<char*>(n_items.data()), n_diffs * sizeof(UnsignedInt));
+  if (!queue_file) return false;
+  const BigUnsignedInt n_items_total = std::accumulate(n_items.begin(), n_items.end(), 0ULL);
+  if (file_size != n_items_offset + n_items_total * (3 + sizeof(double))) return false;
+  item_diffs.resize(n_items_total * 3);
+  item_abs_Hs.resize(n_items_total);
+  queue_file.read(reinterpret_cast<char*>(item_diffs.data()), item_diffs.size());
+  queue_file.read(
+      reinterpret_cast<char*>(item_abs_Hs.data()), item_abs_Hs.size() * sizeof(double));
+  return static_cast<bool>(queue_file);
+}
+
+bool HEGSolver::load_hci_queue(
+    const std::string& filename,
+    const std::size_t n_diffs,
+    std::vector<UnsignedInt>& n_items,
+    std::vector<TinyInt>& item_diffs,
+    std::vector<double>& item_abs_Hs) {
+  // Read by process 0 only and broadcast, so that all the processes take the same branch.
+  bool is_loaded = Parallel::get_id() == 0 &&
+                   read_hci_queue(filename, n_diffs, n_items, item_diffs, item_abs_Hs);
+  Parallel::broadcast(is_loaded);
+  if (!is_loaded) return false;
+  Parallel::broadcast(n_items);
+  Parallel::broadcast(item_diffs);
+  Parallel::broadcast(item_abs_Hs);
+  if (Parallel::get_id() == 0) printf("Loaded HCI queue from: %s\n", filename.c_str());
+  return true;
 }
 
 void HEGSolver::save_variation_result() {
@@ -144,10 +310,25 @@ void HEGSolver::save_variation_result() {
   std::string filename = str(boost::format("var_%.3e_%.3e.txt") % eps_var % rcut_var);
   var_file.open(filename);
   var_file << boost::format("%.15g %.15g\n") % energy_hf % energy_var;
-  var_file << boost::format("%d %d %d\n") % n_up % n_dn % wf.size();
-  for (const auto& term : wf.get_terms()) {
-    var_file << boost::format("%.15g\n") % term.coef;
-    var_file << term.det.up << std::endl << term.det.dn << std::endl;
+  const auto& coefs = wf.get_coefs();
+
+  // Always the dets themselves, so that the file does not depend on the spin flip symmetry.
+  Det det;
+  std::size_t n_dets = 0;
+  for (std::size_t i = 0; i < wf.size(); i++) {
+    wf.get_det(i, det);
+    n_dets += get_n_partners(det);
+  }
+  var_file << boost::format("%d %d %d\n") % n_up % n_dn % n_dets;
+  for (std::size_t i = 0; i < wf.size(); i++) {
+    wf.get_det(i, det);
+    const double coef = get_det_coef(det, coefs[i]);
+    var_file << boost::format("%.15g\n") % coef;
+    var_file << det.up << std::endl << det.dn << std::endl;
+    if (get_n_partners(det) == 2) {
+      var_file << boost::format("%.15g\n") % coef;
+      var_file << det.dn << std::endl << det.up << std::endl;
+    }
   }
   var_file.close();
   printf("Variation result saved to: %s\n", filename.c_str());
@@ -164,6 +345,7 @@ bool HEGSolver::load_variation_result() {
   var_file >> energy_hf >> energy_var;
   var_file >> n_up >> n_dn >> wf_size;
   wf.clear();
+  wf.reserve(wf_size);
   for (std::size_t i = 0; i < wf_size; i++) {
     var_file >> coef;
     Det det;
@@ -175,24 +357,33 @@ bool HEGSolver::load_variation_result() {
       var_file >> orb_id;
       det.dn.set_orb(orb_id, true);
     }
-    wf.append_term(det, coef);
+    if (!spin_flip_symmetry) {
+      wf.append_term(det, coef);
+    } else if (det.is_spin_flip_canonical()) {
+      wf.append_term(det, get_n_partners(det) == 2 ? coef * M_SQRT2 : coef);
+    }
   }
   var_file.close();
+
+  // The connection search and the hamiltonian only handle the momentum sector of HF.
+  const Int3& momentum_hf = get_momentum(generate_hf_det());
+  Det det;
+  for (std::size_t i = 0; i < wf.size(); i++) {
+    wf.get_det(i, det);
+    if (get_momentum(det) != momentum_hf) {
+      throw std::invalid_argument("Dets outside the momentum sector of HF in: " + filename);
+    }
+  }
   if (Parallel::get_id() == 0)
     printf("Loaded %'d dets from: %s\n", static_cast<int>(wf_size), filename.c_str());
   return true;
 }
 
-int get_gamma_exp(const SpinDet& spin_det, const std::vector<Orbital>& eor) {
-  int gamma_exp = 0;
-  int ptr = 0;
-  const auto& occ = spin_det.get_elec_orbs();
-  for (const Orbital orb_id : eor) {
-    if (!spin_det.get_orb(orb_id)) continue;
-    while (occ[ptr] < orb_id) ptr++;
-    gamma_exp += ptr;
-  }
-  return gamma_exp;
+Int3 HEGSolver::get_momentum(const Det& det) const {
+  Int3 momentum = {0, 0, 0};
+  for (const int p : det.up.get_elec_orbs()) momentum += k_points[p];
+  for (const int p : det.dn.get_elec_orbs()) momentum += k_points[p];
+  return momentum;
 }
 
 double HEGSolver::hamiltonian(const Det& det_pq, const Det& det_rs) const {
@@ -223,66 +414,55 @@ double HEGSolver::hamiltonian(const Det& det_pq, const Det& det_rs) const {
     }
   } else {
     // Off-diagonal elements.
-    Det det_eor;
-    det_eor.from_eor(det_pq, det_rs);
-    const std::size_t n_eor_up = det_eor.up.get_n_elecs();
-    const std::size_t n_eor_dn = det_eor.dn.get_n_elecs();
-    if (n_eor_up + n_eor_dn != 4) return 0.0;
-    const auto& eor_up_set_bits = det_eor.up.get_elec_orbs();
-    const auto& eor_dn_set_bits = det_eor.dn.get_elec_orbs();
-    bool k_p_set = false, k_r_set = false;
-    int orb_p = 0, orb_r = 0, orb_s = 0;
-
-    // Obtain p, q, s.
-    Int3 k_change;
-    k_change.fill(0);
-    for (const int orb_i : eor_up_set_bits) {
-      if (det_pq.up.get_orb(orb_i)) {
-        k_change -= k_points[orb_i];
-        if (!k_p_set) {
-          orb_p = orb_i;
-          k_p_set = true;
-        }
-      } else {
-        k_change += k_points[orb_i];
-        if (!k_r_set) {
-          orb_r = orb_i;
-          k_r_set = true;
-        } else {
-          orb_s = orb_i;
-        }
-      }
-    }
-    for (const int orb_i : eor_dn_set_bits) {
-      if (det_pq.dn.get_orb(orb_i)) {
-        k_change -= k_points[orb_i];
-        if (!k_p_set) {
-          orb_p = orb_i;
-          k_p_set = true;
-        }
-      } else {
-        k_change += k_points[orb_i];
-        if (!k_r_set) {
-          orb_r = orb_i;
-          k_r_set = true;
-        } else {
-          orb_s = orb_i;
-        }
-      }
+    switch (n_words) {
+      case 1:
+        return hamiltonian_off_diagonal<1>(det_pq, det_rs);
+      case 2:
+        return hamiltonian_off_diagonal<2>(det_pq, det_rs);
+      case 3:
+        return hamiltonian_off_diagonal<3>(det_pq, det_rs);
+      case 4:
+        return hamiltonian_off_diagonal<4>(det_pq, det_rs);
+      case 6:
+        return hamiltonian_off_diagonal<6>(det_pq, det_rs);
+      case 8:
+        return hamiltonian_off_diagonal<8>(det_pq, det_rs);
+      case 12:
+        return hamiltonian_off_diagonal<12>(det_pq, det_rs);
+      case 16:
+        return hamiltonian_off_diagonal<16>(det_pq, det_rs);
+      case 24:
+        return hamiltonian_off_diagonal<24>(det_pq, det_rs);
+      default:
+        return hamiltonian_off_diagonal<BIT_DET_N_WORDS_MAX>(det_pq, det_rs);
     }
+  }
+  return H;
+}
 
-    // Check for momentum conservation.
-    if (k_change != 0) return 0.0;
+template <std::size_t N>
+double HEGSolver::hamiltonian_off_diagonal(const Det& det_pq, const Det& det_rs) const {
+  Excitation excitation;
+  excitation.from_dets(BitDet<N>(det_pq), BitDet<N>(det_rs));
+  return hamiltonian(excitation);
+}
 
-    H = H_unit / squared_norm(k_points[orb_p] - k_points[orb_r]);
-    if (n_eor_up != 2) H -= H_unit / squared_norm(k_points[orb_p] - k_points[orb_s]);
+double HEGSolver::hamiltonian(const Excitation& excitation) const {
+  if (excitation.get_degree() != 2) return 0.0;
+  const int orb_p = excitation.holes[0];
+  const int orb_q = excitation.holes[1];
+  const int orb_r = excitation.particles[0];
+  const int orb_s = excitation.particles[1];
 
-    const int gamma_exp =
-        get_gamma_exp(det_pq.up, eor_up_set_bits) + get_gamma_exp(det_pq.dn, eor_dn_set_bits) +
-        get_gamma_exp(det_rs.up, eor_up_set_bits) + get_gamma_exp(det_rs.dn, eor_dn_set_bits);
-    if ((gamma_exp & 1) == 1) H = -H;
-  }
-  return H;
+  // Check for momentum conservation. Dets of one momentum sector, such as the variational dets
+  // which all share the momentum of HF, always pass, so the connection search needs no sector
+  // filter: dets sharing a spin string share the other partial momentum too.
+  const Int3& k_change = k_points[orb_r] + k_points[orb_s] - k_points[orb_p] - k_points[orb_q];
+  if (k_change != 0) return 0.0;
+
+  double H = H_unit / squared_norm(k_points[orb_p] - k_points[orb_r]);
+  if (excitation.n_up != 1) H -= H_unit / squared_norm(k_points[orb_p] - k_points[orb_s]);
+  return excitation.sign * H;
 }
 
 std::list<IntPair> get_pq_pairs(const Det& det, const int dn_offset) {
@@ -312,14 +492,44 @@ std::list<IntPair> get_pq_pairs(const Det& det, const int dn_offset) {
   return pq_pairs;
 }
 
-std::list<Det> HEGSolver::find_connected_dets(const Det& det, const double eps) const {
-  std::list<Det> connected_dets;
-  connected_dets.push_back(det);
+void HEGSolver::find_connected_excitations(
+    const Det& det, const double eps, const ExcitationHandler& handler) const {
+  switch (n_words) {
+    case 1:
+      return find_connected_excitations<1>(det, eps, handler);
+    case 2:
+      return find_connected_excitations<2>(det, eps, handler);
+    case 3:
+      return find_connected_excitations<3>(det, eps, handler);
+    case 4:
+      return find_connected_excitations<4>(det, eps, handler);
+    case 6:
+      return find_connected_excitations<6>(det, eps, handler);
+    case 8:
+      return find_connected_excitations<8>(det, eps, handler);
+    case 12:
+      return find_connected_excitations<12>(det, eps, handler);
+    case 16:
+      return find_connected_excitations<16>(det, eps, handler);
+    case 24:
+      return find_connected_excitations<24>(det, eps, handler);
+    default:
+      return find_connected_excitations<BIT_DET_N_WORDS_MAX>(det, eps, handler);
+  }
+}
 
-  if (max_abs_H < eps) return connected_dets;
+template <std::size_t N>
+void HEGSolver::find_connected_excitations(
+    const Det& det, const double eps, const ExcitationHandler& handler) const {
+  if (max_abs_H < eps) return;
 
   const int dn_offset = static_cast<int>(k_points.size());
   const auto& pq_pairs = get_pq_pairs(det, dn_offset);
+  const BitDet<N> bit_det(det);
+  Excitation excitation;
+  const auto& get_spin_orb = [dn_offset](const int orb) {
+    return static_cast<Orbital>(orb >= dn_offset ? orb - dn_offset : orb);
+  };
 
   for (const auto& pq_pair : pq_pairs) {
     const int p = pq_pair.first;
@@ -335,27 +545,27 @@ std::list<Det> HEGSolver::find_connected_dets(const Det& det, const double eps)
       qq = p + dn_offset;
     }
     bool same_spin = false;
-    std::vector<TinyInt3Double> const* items_ptr;
+    const HCIQueue* queue = &opposite_spin_hci_queue;
+    CubicSymmetry symmetry;
     if (pp < dn_offset && qq < dn_offset) {
       same_spin = true;
-      const auto& diff_pq = cast<TinyInt>(k_points[qq] - k_points[pp]);
-      items_ptr = &(same_spin_hci_queue.find(diff_pq)->second);
-    } else {
-      items_ptr = &(opposite_spin_hci_queue);
+      queue = &same_spin_hci_queue;
+      symmetry = CubicSymmetry(cast<TinyInt>(k_points[qq] - k_points[pp]));
     }
-    const auto& items = *items_ptr;
+    const TinyInt3& diff_pq = symmetry.get_canonical();
+    const TinyInt3* diffs = queue->get_diffs();
+    const double* abs_Hs = queue->get_abs_Hs();
+    const std::size_t items_end = queue->end(diff_pq);
     int qs_offset = 0;
     if (!same_spin) qs_offset = dn_offset;
 
-    for (const auto& item : items) {
-      if (item.second < eps) break;
-      const auto& diff_pr = cast<int>(item.first);
-      const auto it_r = k_lut.find(diff_pr + k_points[pp]);
-      if (it_r == k_lut.end()) continue;
-      int r = it_r->second;
-      const auto it_s = k_lut.find(k_points[pp] + k_points[qq - qs_offset] - k_points[r]);
-      if (it_s == k_lut.end()) continue;
-      int s = it_s->second;
+    for (std::size_t k = queue->begin(diff_pq); k < items_end; k++) {
+      if (abs_Hs[k] < eps) break;
+      const Int3& diff_pr = symmetry.from_canonical(diffs[k]);
+      int r = k_lut.find(diff_pr + k_points[pp]);
+      if (r == KPointsLut::NOT_FOUND) continue;
+      int s = k_lut.find(k_points[pp] + k_points[qq - qs_offset] - k_points[r]);
+      if (s == KPointsLut::NOT_FOUND) continue;
       if (same_spin && s < r) continue;
       s += qs_offset;
       if (p >= dn_offset && q >= dn_offset) {
@@ -367,40 +577,132 @@ std::list<Det> HEGSolver::find_connected_dets(const Det& det, const double eps)
         r = tmp - dn_offset;
       }
 
-      // Test whether pqrs is a valid excitation for det.
-      if (det.get_orb(r, dn_offset) || det.get_orb(s, dn_offset)) continue;
-      connected_dets.push_back(det);
-      Det& new_det = connected_dets.back();
-      new_det.set_orb(p, dn_offset, false);
-      new_det.set_orb(q, dn_offset, false);
-      new_det.set_orb(r, dn_offset, true);
-      new_det.set_orb(s, dn_offset, true);
+      // Test whether pqrs is a valid excitation for det. Up orbitals come first in pq and rs.
+      if (bit_det.get_orb(r, dn_offset) || bit_det.get_orb(s, dn_offset)) continue;
+      excitation.from_orbs(
+          det,
+          (p < dn_offset) + (q < dn_offset),
+          {{get_spin_orb(p), get_spin_orb(q)}},
+          {{get_spin_orb(r), get_spin_orb(s)}});
+      handler(excitation, abs_Hs[k]);
     }
   }
+}
 
-  return connected_dets;
-};
+// Largest number of eps_pts, the PT categories are instantiated for 1, 2, 4 and 8 of them.
+const std::size_t PT_N_CATEGORIES_MAX = 8;
 
-#ifndef SERIAL
-template <>
-std::size_t BigUnorderedMap<PTKey, double, boost::hash<PTKey>>::get_target(const PTKey& key) {
-  boost::hash<OrbitalsPair> det_code_hasher;
-  return proc_map[det_code_hasher(key.first) % total_proc_buckets];
+// Smallest instantiated number of PT categories for n_eps eps.
+static std::size_t get_pt_n_categories(const std::size_t n_eps) {
+  if (n_eps > PT_N_CATEGORIES_MAX) {
+    throw std::invalid_argument("Too many eps_pts for the PT categories.");
+  }
+  std::size_t n_categories = 1;
+  while (n_categories < n_eps) n_categories *= 2;
+  return n_categories;
 }
 
-template <>
-const PTKey BigUnorderedMap<PTKey, double, boost::hash<PTKey>>::get_storage_key(const PTKey& key) {
-  Det det_a;
-  PTKey new_key;
-  det_a.decode(key.first, SpinDet::EncodeScheme::FIXED);
-  new_key.first = det_a.encode();  // Use the compact variable length encoding.
-  new_key.second = key.second;
-  return new_key;
+// Partial sums of the PT contributions to an external det, one per PT category.
+template <std::size_t C>
+class PTSums {
+ public:
+  std::array<double, C> sums;
+
+  // Smallest category contributed, sums may cancel exactly due to symmetry.
+  PTCategory min_category;
+
+  PTSums() : min_category(C) { sums.fill(0.0); }
+
+  PTSums& operator+=(const PTSums& rhs) {
+    for (std::size_t i = 0; i < C; i++) sums[i] += rhs.sums[i];
+    min_category = std::min(min_category, rhs.min_category);
+    return *this;
+  }
+
+  template <class Archive>
+  void serialize(Archive& ar, const unsigned int) {
+    for (auto& sum : sums) ar& sum;
+    ar& min_category;
+  }
+};
+
+// Stochastic estimate of the PT partial sums of an external det from sampled variation dets.
+// Category 0 collects the terms above eps_pt_dtm, category c + 1 those of eps_pts category c.
+template <std::size_t C>
+class PTSampleSums {
+ public:
+  std::array<double, C + 1> linear;  // Sum of w_i c_i H_ai / p_i.
+
+  std::array<double, C + 1> quadratic;  // Diagonal correction of the squared sum.
+
+  PTSampleSums() {
+    linear.fill(0.0);
+    quadratic.fill(0.0);
+  }
+
+  PTSampleSums& operator+=(const PTSampleSums& rhs) {
+    for (std::size_t i = 0; i <= C; i++) {
+      linear[i] += rhs.linear[i];
+      quadratic[i] += rhs.quadratic[i];
+    }
+    return *this;
+  }
+
+  template <class Archive>
+  void serialize(Archive& ar, const unsigned int) {
+    for (auto& sum : linear) ar& sum;
+    for (auto& sum : quadratic) ar& sum;
+  }
+};
+
+void HEGSolver::perturbation() {
+  switch (n_words) {
+    case 1:
+      return perturbation<1>();
+    case 2:
+      return perturbation<2>();
+    case 3:
+      return perturbation<3>();
+    case 4:
+      return perturbation<4>();
+    case 6:
+      return perturbation<6>();
+    case 8:
+      return perturbation<8>();
+    case 12:
+      return perturbation<12>();
+    case 16:
+      return perturbation<16>();
+    case 24:
+      return perturbation<24>();
+    default:
+      return perturbation<BIT_DET_N_WORDS_MAX>();
+  }
 }
-#endif
 
+template <std::size_t N>
 void HEGSolver::perturbation() {
   // Perform perturbation with smallest eps and largest rcut.
+  const std::size_t n_categories = get_pt_n_categories(eps_pts.size());
+  const std::string pt_mode = Config::get<std::string>("pt_mode", "deterministic");
+  const bool is_semistochastic = pt_mode == "semistochastic";
+  if (!is_semistochastic && pt_mode != "deterministic") {
+    throw std::invalid_argument("Unknown pt_mode: " + pt_mode);
+  }
+  if (is_semistochastic && spin_flip_symmetry) {
+    throw std::invalid_argument("Semistochastic PT does not support spin_flip_symmetry.");
+  }
+  if (Config::has("pt_n_batches")) {
+    throw std::invalid_argument(
+        "pt_n_batches is now pt_stochastic_n_batches, not to be confused with n_pt_batches.");
+  }
+  if (!is_semistochastic) {
+    for (const auto& key : {"eps_pt_dtm", "pt_n_samples", "pt_stochastic_n_batches", "pt_seed"}) {
+      if (Config::has(key)) {
+        throw std::invalid_argument(std::string(key) + " requires semistochastic pt_mode.");
+      }
+    }
+  }
   const double rcut_pt_max = rcut_pts.back();
   const double eps_pt_min = eps_pts.back();
   k_points = KPointsUtil::generate_k_points(rcut_pt_max);
@@ -413,96 +715,54 @@ void HEGSolver::perturbation() {
 
   // Cache variation determinants.
   var_dets_set.clear();
-  const auto& terms = wf.get_terms();
-  var_dets_set.rehash(terms.size() * 2);  // <20% conflict rate with 50% hash load.
-  for (const auto& term : terms) {
-    var_dets_set.insert(term.det.encode());
-  }
-
-  Time::start("setup hash table");
-  unsigned long long n_pt_dets_estimate = estimate_n_pt_dets(eps_pt_min);
-  if (Parallel::get_id() == 0) printf("Estimated PT terms: %'llu\n", n_pt_dets_estimate);
-  std::pair<PTKey, double> skeleton;  // For reducing the amount of MPI data transfer.
-  skeleton.first.first = wf.get_terms().front().det.encode(SpinDet::EncodeScheme::FIXED);
-  BigUnorderedMap<PTKey, double, boost::hash<PTKey>> pt_sums(skeleton);
-  pt_sums.reserve(static_cast<unsigned long long>(n_pt_dets_estimate));
-  unsigned long long hash_buckets = pt_sums.bucket_count();
-  if (Parallel::get_id() == 0) printf("Reserved %'llu total hash buckets.\n", hash_buckets);
-  Time::end("setup hash table");
-
-  Time::start("search for perturbation dets");
-  int progress = 1;  // For print.
-  std::size_t i = 0;
-  const std::size_t n = wf.size();
-  for (const auto& term : wf.get_terms()) {
-    if ((i++) % Parallel::get_n() != static_cast<std::size_t>(Parallel::get_id())) continue;
-    const auto& connected_dets = find_connected_dets(term.det, eps_pt_min / fabs(term.coef));
-    for (const auto& det_a : connected_dets) {
-      if (var_dets_set.count(det_a.encode()) == 1) continue;
-      const double H_ai = hamiltonian(term.det, det_a);
-      if (fabs(H_ai) < DBL_EPSILON) continue;
-      const double partial_sum = H_ai * term.coef;
-      PTCategory category = get_pt_category(fabs(partial_sum));
-      PTKey ptKey(det_a.encode(SpinDet::EncodeScheme::FIXED), category);
-      pt_sums.async_inc(ptKey, partial_sum);
-    }
-    if (Parallel::get_id() == 0 && i >= n / 100 * progress) {
-      const auto& local_map = pt_sums.get_local_map();
-      Time::checkpoint("search for perturbation dets");
-      printf(
-          "Master progress: %d%%. Local PT keys: %'lu, hash load: %.2f\n",
-          progress,
-          local_map.size(),
-          local_map.load_factor());
-      progress *= 2;
-    }
+  var_dets_set.reserve(wf.size());
+  Det det;
+  for (std::size_t i = 0; i < wf.size(); i++) {
+    wf.get_det(i, det);
+    var_dets_set.insert(det);
   }
-  pt_sums.complete_async_incs();
-  unsigned long long n_pt_keys = pt_sums.size();
-  if (Parallel::get_id() == 0) printf("Total PT keys: %'llu\n", n_pt_keys);
-  Time::end("search for perturbation dets");
 
-  Time::start("accumulate contributions");
-  const auto& local_map = pt_sums.get_local_map();
   std::vector<std::vector<double>> energy_pts;
-  std::vector<std::vector<unsigned long long>> n_pt_dets;
-  energy_pts.resize(rcut_pts.size());
-  n_pt_dets.resize(rcut_pts.size());
-  for (auto& vec : energy_pts) vec.resize(eps_pts.size(), 0.0);
-  for (auto& vec : n_pt_dets) vec.resize(eps_pts.size(), 0);
-  std::vector<double> partial_sums(eps_pts.size(), 0.0);
-  for (const auto& kv : local_map) {
-    const auto& key = kv.first;
-    const PTCategory category = key.second;
-    partial_sums.assign(eps_pts.size(), 0.0);
-    bool is_smallest = true;
-    for (PTCategory related_category = 0; related_category < eps_pts.size(); related_category++) {
-      const PTKey related_key(key.first, related_category);
-      if (local_map.count(related_key) == 1) {
-        // Only the smallest one submits the contribution.
-        if (related_category < category) {
-          is_smallest = false;
-          break;
-        }
-        partial_sums[related_category] = local_map.at(related_key);
-      }
+  std::vector<std::vector<double>> energy_pt_errors;
+  std::vector<std::vector<unsigned long long>> n_pt_dets;  // Only at eps_pt_dtm if semistochastic.
+  if (is_semistochastic) {
+    // Deterministic at a loose eps, plus a sampled correction down to each eps_pt.
+    const double eps_pt_dtm = Config::get<double>("eps_pt_dtm");
+    if (eps_pt_dtm < eps_pts.front()) {
+      throw std::invalid_argument("eps_pt_dtm must not be smaller than eps_pts.");
     }
-    if (is_smallest) {
-      for (PTCategory i = 1; i < eps_pts.size(); i++) partial_sums[i] += partial_sums[i - 1];
-      for (PTCategory i = category; i < eps_pts.size(); i++) partial_sums[i] *= partial_sums[i];
-      Det det_a;
-      det_a.decode(key.first);
-      // det_a.decode(key.first, SpinDet::EncodeScheme::FIXED);
-      const double H_aa = hamiltonian(det_a, det_a);
-      const double factor = 1.0 / (energy_var - H_aa);
-      std::size_t n_orbs_used = Det::get_n_orbs_used(key.first);
-      for (std::size_t i = 0; i < n_orbs_pts.size(); i++) {
-        if (n_orbs_used > n_orbs_pts[i]) continue;
-        for (std::size_t j = category; j < eps_pts.size(); j++) {
-          n_pt_dets[i][j]++;
-          energy_pts[i][j] += partial_sums[j] * factor;
-        }
-      }
+    if (Parallel::get_id() == 0) printf("Semistochastic PT with eps_pt_dtm = %#.4g\n", eps_pt_dtm);
+    std::vector<std::vector<double>> energy_pts_dtm;
+    perturbation_deterministic<N, 1>({eps_pt_dtm}, energy_pts_dtm, n_pt_dets);
+    switch (n_categories) {
+      case 1:
+        perturbation_stochastic<N, 1>(eps_pt_dtm, energy_pts, energy_pt_errors);
+        break;
+      case 2:
+        perturbation_stochastic<N, 2>(eps_pt_dtm, energy_pts, energy_pt_errors);
+        break;
+      case 4:
+        perturbation_stochastic<N, 4>(eps_pt_dtm, energy_pts, energy_pt_errors);
+        break;
+      default:
+        perturbation_stochastic<N, PT_N_CATEGORIES_MAX>(eps_pt_dtm, energy_pts, energy_pt_errors);
+    }
+    for (std::size_t i = 0; i < rcut_pts.size(); i++) {
+      for (auto& energy_pt : energy_pts[i]) energy_pt += energy_pts_dtm[i][0];
+    }
+  } else {
+    switch (n_categories) {
+      case 1:
+        perturbation_deterministic<N, 1>(eps_pts, energy_pts, n_pt_dets);
+        break;
+      case 2:
+        perturbation_deterministic<N, 2>(eps_pts, energy_pts, n_pt_dets);
+        break;
+      case 4:
+        perturbation_deterministic<N, 4>(eps_pts, energy_pts, n_pt_dets);
+        break;
+      default:
+        perturbation_deterministic<N, PT_N_CATEGORIES_MAX>(eps_pts, energy_pts, n_pt_dets);
     }
   }
 
@@ -510,50 +770,317 @@ void HEGSolver::perturbation() {
   for (std::size_t i = 0; i < rcut_pts.size(); i++) {
     const double rcut_pt = rcut_pts[i];
     std::size_t n_orbs_pt = KPointsUtil::get_n_k_points(rcut_pt) * 2;
-    std::string n_orbs_pt_event = "accumulate for n_orbs_pt: " + std::to_string(n_orbs_pt);
-    Time::start(n_orbs_pt_event);
+    if (is_semistochastic && Parallel::get_id() == 0) {
+      printf("Number of deterministic PT dets at eps_pt_dtm: %'llu\n", n_pt_dets[i][0]);
+    }
     for (std::size_t j = 0; j < eps_pts.size(); j++) {
       const double eps_pt = eps_pts[j];
-      std::string eps_pt_event = str(boost::format("accumulate for eps_pt: %.4g") % eps_pt);
-      Time::start(eps_pt_event);
       energy_pt = energy_pts[i][j];
-      unsigned long long n_pt_dets_cur = n_pt_dets[i][j];
-      Parallel::reduce_to_sum(energy_pt);
-      Parallel::reduce_to_sum(n_pt_dets_cur);
       const double correlation_energy = energy_var + energy_pt - energy_hf;
       std::size_t n_orbs_var = KPointsUtil::get_n_k_points(rcut_var) * 2;
       if (Parallel::get_id() == 0) {
-        printf("Number of related PT dets: %'llu\n", n_pt_dets_cur);
+        if (!is_semistochastic) printf("Number of related PT dets: %'llu\n", n_pt_dets[i][j]);
         printf("n_orbs_var: %d\n", static_cast<int>(n_orbs_var));
         printf("eps_var: %#.4g\n", eps_var);
         printf("n_orbs_pt: %d\n", static_cast<int>(n_orbs_pt));
         printf("eps_pt: %#.4g\n", eps_pt);
         printf("Perturbation energy: %#.12g Ha\n", energy_pt);
+        if (is_semistochastic) {
+          printf("Perturbation energy error: %#.4g Ha\n", energy_pt_errors[i][j]);
+        }
         printf("Correlation Energy: %.12g Ha\n", correlation_energy);
         std::vector<double> parameter_set({1.0 / n_orbs_var, eps_var, 1.0 / n_orbs_pt, eps_pt});
         parameter_sets.push_back(parameter_set);
         printf("Number of parameter sets: %d\n", static_cast<int>(parameter_sets.size()));
         results.push_back(correlation_energy);
       }
-      Time::end(eps_pt_event);
     }  // eps_pts loop.
-    Time::end(n_orbs_pt_event);
   }  // n_orbs_pts loop.
-  Time::end("accumulate contributions");
+}
+
+// Bound of the combiner of the remote PT increments of each process.
+static std::size_t get_pt_combiner_size() {
+  return Config::get<std::size_t>("pt_combiner_size", BIG_UNORDERED_MAP_COMBINER_SIZE_DEFAULT);
+}
+
+template <std::size_t N, std::size_t C>
+void HEGSolver::perturbation_deterministic(
+    const std::vector<double>& eps_list,
+    std::vector<std::vector<double>>& energy_pts,
+    std::vector<std::vector<unsigned long long>>& n_pt_dets) {
+  const double eps_pt_min = eps_list.back();
+  const auto& coefs = wf.get_coefs();
+  const std::size_t n_eps = eps_list.size();
+
+  // PT dets are split by hash into n_pt_batches passes over the variation dets, so that
+  // only one share of the PT dets is stored at a time.
+  const std::size_t n_batches = Config::get<std::size_t>("n_pt_batches", 1);
+  if (n_batches == 0) throw std::invalid_argument("n_pt_batches must be positive.");
+
+  Time::start("setup hash table");
+  unsigned long long n_pt_dets_estimate = estimate_n_pt_dets(eps_pt_min);
+  if (Parallel::get_id() == 0) printf("Estimated PT terms: %'llu\n", n_pt_dets_estimate);
+  BigUnorderedMap<BitDet<N>, PTSums<C>, BitDetHasher<N>> pt_sums(get_pt_combiner_size());
+  pt_sums.reserve(static_cast<unsigned long long>(n_pt_dets_estimate / n_batches));
+  unsigned long long hash_buckets = pt_sums.bucket_count();
+  if (Parallel::get_id() == 0) printf("Reserved %'llu total hash buckets.\n", hash_buckets);
+  Time::end("setup hash table");
+
+  std::vector<double> energy_pts_flat(rcut_pts.size() * n_eps, 0.0);
+  std::vector<unsigned long long> n_pt_dets_flat(rcut_pts.size() * n_eps, 0);
+  const BitDetHasher<N> hasher;
+  for (std::size_t batch_id = 0; batch_id < n_batches; batch_id++) {
+    if (n_batches > 1 && Parallel::get_id() == 0) {
+      printf("PT batch %lu/%lu\n", batch_id + 1, n_batches);
+    }
+
+    Time::start("search for perturbation dets");
+    int progress = 1;  // For print.
+    const std::size_t n = wf.size();
+    Det det_i;
+    BitDet<N> bit_det_a;
+    PTSums<C> contribution;
+    for (std::size_t i = 0; i < n; i++) {
+      if (i % Parallel::get_n() != static_cast<std::size_t>(Parallel::get_id())) continue;
+      wf.get_det(i, det_i);
+      const double coef_i = get_det_coef(det_i, coefs[i]);
+      const BitDet<N> bit_det_i(det_i);
+      const bool is_i_paired = get_n_partners(det_i) == 2;
+      const auto& pt_handler = [&](const Excitation& excitation, const double) {
+        bit_det_a = bit_det_i;
+        excitation.apply_to(bit_det_a);
+
+        // With spin flip symmetry, the sums are kept for the canonical dets. The flipped det_i
+        // reaches det_a where det_i reaches the flipped det_a, with the same H, so each of its
+        // terms lands on the canonical one of the two. Unpaired det_i reaches both and counts
+        // once, paired det_i reaches an unpaired det_a once for the two of them.
+        double multiplicity = 1.0;
+        if (spin_flip_symmetry) {
+          if (!bit_det_a.is_spin_flip_canonical()) {
+            if (!is_i_paired) return;
+            bit_det_a.flip_spins();
+          } else if (is_i_paired && bit_det_a.up == bit_det_a.dn) {
+            multiplicity = 2.0;
+          }
+        }
+        if (n_batches > 1 && hasher(bit_det_a) % n_batches != batch_id) return;
+        if (var_dets_set.count(bit_det_a) == 1) return;
+        const double H_ai = hamiltonian(excitation);
+        if (fabs(H_ai) < DBL_EPSILON) return;
+        const double partial_sum = H_ai * coef_i;
+        const PTCategory category = get_pt_category(fabs(partial_sum), eps_list);
+        if (category >= n_eps) return;
+        contribution.sums[category] = partial_sum * multiplicity;
+        contribution.min_category = category;
+        pt_sums.async_inc(bit_det_a, contribution);
+        contribution.sums[category] = 0.0;
+      };
+      find_connected_excitations(det_i, eps_pt_min / fabs(coef_i), pt_handler);
+      if (Parallel::get_id() == 0 && i + 1 >= n / 100 * progress) {
+        const auto& local_map = pt_sums.get_local_map();
+        Time::checkpoint("search for perturbation dets");
+        printf(
+            "Master progress: %d%%. Local PT keys: %'lu, hash load: %.2f\n",
+            progress,
+            local_map.size(),
+            local_map.load_factor());
+        progress *= 2;
+      }
+    }
+    pt_sums.complete_async_incs();
+    unsigned long long n_pt_keys = pt_sums.size();
+    if (Parallel::get_id() == 0) printf("Total PT keys: %'llu\n", n_pt_keys);
+    Time::end("search for perturbation dets");
+
+    Time::start("accumulate contributions");
+    const auto& local_map = pt_sums.get_local_map();
+    std::vector<double> partial_sums(n_eps, 0.0);
+    for (const auto& kv : local_map) {
+      const auto& sums = kv.second.sums;
+      const PTCategory category = kv.second.min_category;
+      partial_sums[0] = sums[0];
+      for (PTCategory i = 1; i < n_eps; i++) partial_sums[i] = partial_sums[i - 1] + sums[i];
+      for (PTCategory i = category; i < n_eps; i++) partial_sums[i] *= partial_sums[i];
+      const Det& det_a = kv.first.to_det();
+      const double H_aa = hamiltonian(det_a, det_a);
+      const std::size_t n_partners = get_n_partners(kv.first);  // Same sums and H_aa.
+      const double factor = n_partners / (energy_var - H_aa);
+      std::size_t n_orbs_used = kv.first.get_n_orbs_used();
+      for (std::size_t i = 0; i < n_orbs_pts.size(); i++) {
+        if (n_orbs_used > n_orbs_pts[i]) continue;
+        for (std::size_t j = category; j < n_eps; j++) {
+          n_pt_dets_flat[i * n_eps + j] += n_partners;
+          energy_pts_flat[i * n_eps + j] += partial_sums[j] * factor;
+        }
+      }
+    }
+    pt_sums.clear();
+    Time::end("accumulate contributions");
+  }  // PT batches loop.
+
+  Parallel::reduce_to_sum(energy_pts_flat);
+  Parallel::reduce_to_sum(n_pt_dets_flat);
+  energy_pts.resize(rcut_pts.size());
+  n_pt_dets.resize(rcut_pts.size());
+  for (std::size_t i = 0; i < rcut_pts.size(); i++) {
+    const std::size_t begin = i * n_eps;
+    energy_pts[i].assign(energy_pts_flat.begin() + begin, energy_pts_flat.begin() + begin + n_eps);
+    n_pt_dets[i].assign(n_pt_dets_flat.begin() + begin, n_pt_dets_flat.begin() + begin + n_eps);
+  }
+}
+
+// Unbiased PT estimate from n variation dets sampled with probability p_i = |c_i| / sum|c|,
+// where det i is drawn w_i times. Each connected det a contributes 1 / (E_var - H_aa) times
+// [(sum_i w_i c_i H_ai / p_i)^2 + sum_i (w_i (n - 1) / p_i - w_i^2 / p_i^2) (c_i H_ai)^2]
+// divided by n (n - 1).
+// Each batch estimates the difference from the eps_pt_dtm result and only holds its own samples.
+template <std::size_t N, std::size_t C>
+void HEGSolver::perturbation_stochastic(
+    const double eps_pt_dtm,
+    std::vector<std::vector<double>>& energy_pts,
+    std::vector<std::vector<double>>& energy_pt_errors) {
+  const std::size_t n_samples = Config::get<std::size_t>("pt_n_samples", 1000);
+  const std::size_t n_batches = Config::get<std::size_t>("pt_stochastic_n_batches", 16);
+  const unsigned long long seed = Config::get<unsigned long long>("pt_seed", 0);
+  if (n_samples < 2 || n_batches < 2) {
+    throw std::invalid_argument("pt_n_samples and pt_stochastic_n_batches must be at least 2.");
+  }
+  const double eps_pt_min = eps_pts.back();
+  const auto& coefs = wf.get_coefs();
+  const std::size_t n = wf.size();
+  const std::size_t n_eps = eps_pts.size();
+  const std::size_t proc_id = Parallel::get_id();
+  const std::size_t n_procs = Parallel::get_n();
+
+  Time::start("stochastic perturbation");
+  if (Parallel::get_id() == 0) {
+    printf("Stochastic PT with %lu batches of %lu samples\n", n_batches, n_samples);
+  }
+  std::vector<double> abs_coefs(n);
+  for (std::size_t i = 0; i < n; i++) abs_coefs[i] = fabs(coefs[i]);
+  const double sum_abs_coefs = std::accumulate(abs_coefs.begin(), abs_coefs.end(), 0.0);
+  std::discrete_distribution<std::size_t> sample_dist(abs_coefs.begin(), abs_coefs.end());
+  std::mt19937_64 rng(seed);  // Same stream on all processes.
+
+  BigUnorderedMap<BitDet<N>, PTSampleSums<C>, BitDetHasher<N>> pt_sums(get_pt_combiner_size());
+  std::vector<std::size_t> samples(n_samples);
+  std::vector<double> energy_pts_batch(rcut_pts.size() * n_eps);
+  std::vector<double> energy_pts_sum(rcut_pts.size() * n_eps, 0.0);
+  std::vector<double> energy_pts_sq_sum(rcut_pts.size() * n_eps, 0.0);
+  std::vector<double> corrections(n_eps);
+  Det det_i;
+  BitDet<N> bit_det_a;
+  PTSampleSums<C> contribution;
+  for (std::size_t batch_id = 0; batch_id < n_batches; batch_id++) {
+    for (auto& sample : samples) sample = sample_dist(rng);
+    std::sort(samples.begin(), samples.end());
+
+    // Search from the distinct sampled dets, striped over processes.
+    std::size_t unique_id = 0;
+    for (std::size_t k = 0; k < n_samples;) {
+      const std::size_t i = samples[k];
+      std::size_t w_i = 0;
+      while (k < n_samples && samples[k] == i) {
+        w_i++;
+        k++;
+      }
+      if (unique_id++ % n_procs != proc_id) continue;
+      wf.get_det(i, det_i);
+      const double coef_i = coefs[i];
+      const double p_i = abs_coefs[i] / sum_abs_coefs;
+      const double linear_i = w_i * coef_i / p_i;
+      const double quadratic_i =
+          (w_i * (n_samples - 1) / p_i - w_i * w_i / (p_i * p_i)) * coef_i * coef_i;
+      const BitDet<N> bit_det_i(det_i);
+      const auto& pt_handler = [&](const Excitation& excitation, const double) {
+        bit_det_a = bit_det_i;
+        excitation.apply_to(bit_det_a);
+        if (var_dets_set.count(bit_det_a) == 1) return;
+        const double H_ai = hamiltonian(excitation);
+        if (fabs(H_ai) < DBL_EPSILON) return;
+        const double abs_partial_sum = fabs(H_ai * coef_i);
+        const PTCategory category = abs_partial_sum >= eps_pt_dtm
+                                        ? 0
+                                        : get_pt_category(abs_partial_sum, eps_pts) + 1;
+        if (category > n_eps) return;
+        contribution.linear[category] = linear_i * H_ai;
+        contribution.quadratic[category] = quadratic_i * H_ai * H_ai;
+        pt_sums.async_inc(bit_det_a, contribution);
+        contribution.linear[category] = 0.0;
+        contribution.quadratic[category] = 0.0;
+      };
+      find_connected_excitations(det_i, eps_pt_min / abs_coefs[i], pt_handler);
+    }
+    pt_sums.complete_async_incs();
+
+    // Estimate of this batch relative to the eps_pt_dtm one.
+    std::fill(energy_pts_batch.begin(), energy_pts_batch.end(), 0.0);
+    const double normalization = 1.0 / (n_samples * (n_samples - 1.0));
+    for (const auto& kv : pt_sums.get_local_map()) {
+      const auto& linear = kv.second.linear;
+      const auto& quadratic = kv.second.quadratic;
+      const Det& det_a = kv.first.to_det();
+      const double H_aa = hamiltonian(det_a, det_a);
+      const double factor = normalization / (energy_var - H_aa);
+      double linear_sum = linear[0];
+      double quadratic_sum = quadratic[0];
+      const double estimate_dtm = linear_sum * linear_sum + quadratic_sum;
+      for (std::size_t j = 0; j < n_eps; j++) {
+        linear_sum += linear[j + 1];
+        quadratic_sum += quadratic[j + 1];
+        corrections[j] = (linear_sum * linear_sum + quadratic_sum - estimate_dtm) * factor;
+      }
+      std::size_t n_orbs_used = kv.first.get_n_orbs_used();
+      for (std::size_t i = 0; i < n_orbs_pts.size(); i++) {
+        if (n_orbs_used > n_orbs_pts[i]) continue;
+        for (std::size_t j = 0; j < n_eps; j++) energy_pts_batch[i * n_eps + j] += corrections[j];
+      }
+    }
+    pt_sums.clear();
+    Parallel::reduce_to_sum(energy_pts_batch);
+    for (std::size_t k = 0; k < energy_pts_batch.size(); k++) {
+      energy_pts_sum[k] += energy_pts_batch[k];
+      energy_pts_sq_sum[k] += energy_pts_batch[k] * energy_pts_batch[k];
+    }
+    if (Parallel::get_id() == 0) {
+      Time::checkpoint("stochastic perturbation");
+      printf(
+          "PT batch %lu: correction %#.8g Ha, mean %#.8g Ha\n",
+          batch_id + 1,
+          energy_pts_batch.back(),
+          energy_pts_sum.back() / (batch_id + 1));
+    }
+  }
+
+  // Mean and standard error over batches.
+  energy_pts.resize(rcut_pts.size());
+  energy_pt_errors.resize(rcut_pts.size());
+  for (std::size_t i = 0; i < rcut_pts.size(); i++) {
+    energy_pts[i].resize(n_eps);
+    energy_pt_errors[i].resize(n_eps);
+    for (std::size_t j = 0; j < n_eps; j++) {
+      const double mean = energy_pts_sum[i * n_eps + j] / n_batches;
+      const double sq_mean = energy_pts_sq_sum[i * n_eps + j] / n_batches;
+      const double variance = std::max(sq_mean - mean * mean, 0.0) * n_batches / (n_batches - 1);
+      energy_pts[i][j] = mean;
+      energy_pt_errors[i][j] = sqrt(variance / n_batches);
+    }
+  }
+  Time::end("stochastic perturbation");
 }
 
 std::vector<PTCategory> HEGSolver::get_related_pt_categories(const double eps) {
   std::vector<PTCategory> related_categories;
   for (const double eps_pt : eps_pts) {
     if (eps > eps_pt) continue;
-    related_categories.push_back(get_pt_category(eps_pt));
+    related_categories.push_back(get_pt_category(eps_pt, eps_pts));
   }
   return related_categories;
 }
 
-PTCategory HEGSolver::get_pt_category(const double eps) {
-  PTCategory category_eps = eps_pts.size();
-  for (const double eps_pt : eps_pts) {
+PTCategory HEGSolver::get_pt_category(const double eps, const std::vector<double>& eps_list) {
+  PTCategory category_eps = eps_list.size();
+  for (const double eps_pt : eps_list) {
     if (eps >= eps_pt) category_eps--;
   }
   return category_eps;
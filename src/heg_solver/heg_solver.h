@@ -1,12 +1,14 @@
 #ifndef HCI_HEG_SOLVER_H_
 #define HCI_HEG_SOLVER_H_
 
-#include <boost/functional/hash.hpp>
 #include "../std.h"
 
 #include "../det/det.h"
+#include "../det/excitation.h"
 #include "../solver/solver.h"
 #include "../types.h"
+#include "hci_queue.h"
+#include "k_points_util.h"
 
 class HEGSolver : public Solver {
  private:
@@ -16,16 +18,17 @@ class HEGSolver : public Solver {
   double rcut_pt;
   std::size_t n_orbs_var;
   std::size_t n_orbs_pt;
+  std::size_t n_words;  // Bitstring det width, selected from the largest rcut at startup.
   std::vector<double> rcut_vars;
   std::vector<double> eps_vars;
   std::vector<double> rcut_pts;
   std::vector<double> eps_pts;
   std::vector<std::size_t> n_orbs_pts;  // Corresponding to rcut_pts.
   std::vector<Int3> k_points;  // O(k_points).
-  std::unordered_map<Int3, std::size_t, boost::hash<Int3>> k_lut;  // O(k_points).
-  std::unordered_map<TinyInt3, std::vector<TinyInt3Double>, boost::hash<TinyInt3>>
-      same_spin_hci_queue;  // O(k_points^2).
-  std::vector<TinyInt3Double> opposite_spin_hci_queue;  // O(k_points).
+  KPointsLut k_lut;  // O(k_points).
+  HCIQueue same_spin_hci_queue;  // By canonical diff_pq, O(k_points^2 / 48).
+  HCIQueue opposite_spin_hci_queue;  // O(k_points).
+  double hci_queue_rcut;  // Of the current queues.
   std::vector<std::vector<double>> parameter_sets;
   std::vector<std::string> parameter_names;
   std::vector<double> results;
@@ -41,21 +44,76 @@ class HEGSolver : public Solver {
 
   void generate_hci_queue(const double rcut);
 
+  // Same spin queue of each of diff_pqs over k_diffs in units of H_unit, flattened, built across
+  // processes.
+  void generate_same_spin_hci_queue(
+      const double rcut,
+      const std::vector<TinyInt3>& diff_pqs,
+      const std::vector<TinyInt3>& k_diffs,
+      std::vector<UnsignedInt>& n_items,
+      std::vector<TinyInt>& item_diffs,
+      std::vector<double>& item_abs_Hs);
+
+  void save_hci_queue(
+      const std::string& filename,
+      const std::vector<UnsignedInt>& n_items,
+      const std::vector<TinyInt>& item_diffs,
+      const std::vector<double>& item_abs_Hs);
+
+  // False on all the processes if process 0 could not read a queue for these k points.
+  bool load_hci_queue(
+      const std::string& filename,
+      const std::size_t n_diffs,
+      std::vector<UnsignedInt>& n_items,
+      std::vector<TinyInt>& item_diffs,
+      std::vector<double>& item_abs_Hs);
+
   void save_variation_result();
 
   bool load_variation_result();
 
-  PTCategory get_pt_category(const double);
+  // Sum of the k points of all the electrons, conserved by the hamiltonian.
+  Int3 get_momentum(const Det&) const;
+
+  PTCategory get_pt_category(const double, const std::vector<double>& eps_list);
 
   std::vector<PTCategory> get_related_pt_categories(const double);
 
   void perturbation();
 
+  template <std::size_t N>
+  void perturbation();
+
+  // Energies and dets counts per rcut_pt and eps in eps_list, summed over processes.
+  // C is the number of PT categories kept per det, at least the size of eps_list.
+  template <std::size_t N, std::size_t C>
+  void perturbation_deterministic(
+      const std::vector<double>& eps_list,
+      std::vector<std::vector<double>>& energy_pts,
+      std::vector<std::vector<unsigned long long>>& n_pt_dets);
+
+  // Sampled difference of each eps_pt from eps_pt_dtm, with its standard error.
+  template <std::size_t N, std::size_t C>
+  void perturbation_stochastic(
+      const double eps_pt_dtm,
+      std::vector<std::vector<double>>& energy_pts,
+      std::vector<std::vector<double>>& energy_pt_errors);
+
   void extrapolate();
 
   double hamiltonian(const Det&, const Det&) const override;
 
-  std::list<Det> find_connected_dets(const Det&, const double eps) const override;
+  template <std::size_t N>
+  double hamiltonian_off_diagonal(const Det&, const Det&) const;
+
+  double hamiltonian(const Excitation&) const override;
+
+  void find_connected_excitations(
+      const Det&, const double eps, const ExcitationHandler& handler) const override;
+
+  template <std::size_t N>
+  void find_connected_excitations(
+      const Det&, const double eps, const ExcitationHandler& handler) const;
 
  public:
   static void run() { HEGSolver::get_instance().solve(); }
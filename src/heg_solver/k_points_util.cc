@@ -31,11 +31,26 @@ std::size_t KPointsUtil::get_n_k_points(const double rcut) {
   return n_k_points;
 }
 
-std::unordered_map<Int3, std::size_t, boost::hash<Int3>> KPointsUtil::generate_k_lut(
-    const std::vector<Int3>& k_points) {
-  std::unordered_map<Int3, std::size_t, boost::hash<Int3>> k_lut;
-  for (std::size_t i = 0; i < k_points.size(); i++) k_lut[k_points[i]] = i;
-  return k_lut;
+const int KPointsLut::NOT_FOUND;
+
+KPointsLut::KPointsLut(const std::vector<Int3>& k_points) {
+  int n_max = 0;
+  for (const auto& k_point : k_points) {
+    for (const int k : k_point) n_max = std::max(n_max, abs(k));
+  }
+
+  // Momentum conservation probes k_p + k_q - k_r, up to three times n_max.
+  offset = n_max * 3;
+  length = offset * 2 + 1;
+  lut.assign(length * length * length, NOT_FOUND);
+  for (std::size_t i = 0; i < k_points.size(); i++) {
+    const auto& k = k_points[i];
+    lut[((k[0] + offset) * length + k[1] + offset) * length + k[2] + offset] = i;
+  }
+}
+
+KPointsLut KPointsUtil::generate_k_lut(const std::vector<Int3>& k_points) {
+  return KPointsLut(k_points);
 }
 
 std::vector<TinyInt3> KPointsUtil::get_k_diffs(const std::vector<Int3>& k_points) {
@@ -7,12 +7,67 @@
 #include "../array_math.h"
 #include "../types.h"
 
+// Dense k point to index table over a cube wide enough to cover the sums and differences
+// of k points probed during the HCI search. Points outside rcut map to NOT_FOUND.
+class KPointsLut {
+ public:
+  static const int NOT_FOUND = -1;
+
+  KPointsLut() : offset(0), length(0) {}
+
+  KPointsLut(const std::vector<Int3>& k_points);
+
+  int find(const Int3& k) const {
+    const int x = k[0] + offset;
+    const int y = k[1] + offset;
+    const int z = k[2] + offset;
+    assert(x >= 0 && x < length && y >= 0 && y < length && z >= 0 && z < length);
+    return lut[(x * length + y) * length + z];
+  }
+
+ private:
+  int offset;
+  int length;
+  std::vector<int> lut;
+};
+
+// One of the 48 operations of the cubic group, the one taking diff to its canonical image with
+// canonical[0] >= canonical[1] >= canonical[2] >= 0. The k point grid is symmetric under all of
+// them, so quantities of diff can be derived from those of its canonical image.
+class CubicSymmetry {
+ public:
+  CubicSymmetry() : perm({0, 1, 2}), signs({1, 1, 1}), canonical({0, 0, 0}) {}
+
+  explicit CubicSymmetry(const TinyInt3& diff) : perm({0, 1, 2}) {
+    for (int i = 0; i < 3; i++) signs[i] = diff[i] < 0 ? -1 : 1;
+    for (int i = 1; i < 3; i++) {
+      for (int j = i; j > 0 && abs(diff[perm[j]]) > abs(diff[perm[j - 1]]); j--) {
+        std::swap(perm[j], perm[j - 1]);
+      }
+    }
+    for (int i = 0; i < 3; i++) canonical[i] = signs[perm[i]] * diff[perm[i]];
+  }
+
+  const TinyInt3& get_canonical() const { return canonical; }
+
+  // Image of k under the inverse operation, i.e. from the canonical frame back to that of diff.
+  Int3 from_canonical(const TinyInt3& k) const {
+    Int3 res;
+    for (int i = 0; i < 3; i++) res[perm[i]] = signs[perm[i]] * k[i];
+    return res;
+  }
+
+ private:
+  std::array<int, 3> perm;  // canonical[i] is +-diff[perm[i]].
+  std::array<int, 3> signs;  // Of each component of diff.
+  TinyInt3 canonical;
+};
+
 class KPointsUtil {
  public:
   static std::size_t get_n_k_points(const double rcut);
   static std::vector<Int3> generate_k_points(const double rcut);
-  static std::unordered_map<Int3, std::size_t, boost::hash<Int3>> generate_k_lut(
-      const std::vector<Int3>& k_points);
+  static KPointsLut generate_k_lut(const std::vector<Int3>& k_points);
   static std::vector<TinyInt3> get_k_diffs(const std::vector<Int3>& k_points);
 };
 
@@ -0,0 +1,34 @@
+#include "k_points_util.h"
+#include "../det/bit_det.h"
+#include "gtest/gtest.h"
+
+TEST(KPointsUtilTest, GenerateKPointsAndLut) {
+  const auto& k_points = KPointsUtil::generate_k_points(1.5);
+  EXPECT_EQ(k_points.size(), KPointsUtil::get_n_k_points(1.5));
+  EXPECT_EQ(k_points.size(), 19);
+  const auto& k_lut = KPointsUtil::generate_k_lut(k_points);
+  for (std::size_t i = 0; i < k_points.size(); i++) {
+    EXPECT_EQ(k_lut.find(k_points[i]), static_cast<int>(i));
+  }
+  EXPECT_EQ(k_lut.find(Int3({1, 1, 1})), KPointsLut::NOT_FOUND);
+  EXPECT_EQ(k_lut.find(Int3({3, -3, 3})), KPointsLut::NOT_FOUND);
+}
+
+TEST(KPointsUtilTest, CubicSymmetry) {
+  const TinyInt3 diff = {-1, 3, 0};
+  const CubicSymmetry symmetry(diff);
+  EXPECT_EQ(symmetry.get_canonical(), TinyInt3({3, 1, 0}));
+  EXPECT_EQ(symmetry.from_canonical(symmetry.get_canonical()), Int3({-1, 3, 0}));
+  EXPECT_EQ(symmetry.from_canonical(TinyInt3({2, -1, 1})), Int3({1, 2, 1}));
+  EXPECT_EQ(CubicSymmetry().from_canonical(TinyInt3({2, -1, 1})), Int3({2, -1, 1}));
+}
+
+TEST(KPointsUtilTest, BitDetWidthForTemplate2Rcuts) {
+  // The rcut_pts of config.json.template2.
+  for (const double rcut : {5.0, 5.5, 6.0, 6.5, 7.0, 7.5}) {
+    const std::size_t n_k_points = KPointsUtil::get_n_k_points(rcut);
+    const std::size_t n_words = get_bit_det_width(get_n_bit_det_words(n_k_points));
+    EXPECT_GE(n_words * 64, n_k_points);
+    EXPECT_LE(n_words, BIT_DET_N_WORDS_MAX);
+  }
+}
@@ -3,6 +3,10 @@
 
 #ifndef SERIAL
 #include <boost/mpi.hpp>
+#include <boost/serialization/vector.hpp>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
 #endif
 #include "std.h"
 
@@ -34,6 +38,23 @@ class Parallel {
 
   static std::string get_host() { return Parallel::get_instance().env->processor_name(); }
 
+  // OpenMP threads within the process, 1 if built without OpenMP.
+  static int get_n_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+  }
+
+  static int get_thread_id() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+  }
+
   static void barrier() {
     fflush(stdout);
     Parallel::get_instance().world.barrier();
@@ -51,6 +72,18 @@ class Parallel {
     boost::mpi::reduce(Parallel::get_instance().world, t_local, t, std::plus<T>(), 0);
     boost::mpi::broadcast(Parallel::get_instance().world, t, 0);
   }
+
+  // t of process 0, on all the processes.
+  template <class T>
+  static void broadcast(T& t) {
+    boost::mpi::broadcast(Parallel::get_instance().world, t, 0);
+  }
+
+  // ts[k] is t of process k, on all the processes.
+  template <class T>
+  static void all_gather(const T& t, std::vector<T>& ts) {
+    boost::mpi::all_gather(Parallel::get_instance().world, t, ts);
+  }
 };
 #else
 // Non-MPI stub for debugging and memory profiling.
@@ -71,10 +104,35 @@ class Parallel {
 
   static std::string get_host() { return "localhost"; }
 
+  // OpenMP threads within the process, 1 if built without OpenMP.
+  static int get_n_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+  }
+
+  static int get_thread_id() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+  }
+
   static void barrier() { return; }
 
   template <class T>
   static void reduce_to_sum(T& t) {}
+
+  template <class T>
+  static void broadcast(T& t) {}
+
+  template <class T>
+  static void all_gather(const T& t, std::vector<T>& ts) {
+    ts.assign(1, t);
+  }
 };
 #endif
 
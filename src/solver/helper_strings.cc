@@ -1,95 +1,210 @@
 #include "helper_strings.h"
 
-#include "../parallel.h"
+#include <limits>
 
-void HelperStrings::setup_ab() {
-  for (std::size_t i = Parallel::get_id(); i < dets.size(); i += Parallel::get_n()) {
-    ab[dets[i].up.encode()].first.push_back(i);
-    ab[dets[i].dn.encode()].second.push_back(i);
+const UnsignedInt HelperStrings::NOT_FOUND = std::numeric_limits<UnsignedInt>::max();
+
+void DetIdLists::extend(
+    const std::vector<std::pair<UnsignedInt, UnsignedInt>>& entries, const std::size_t n_keys) {
+  const std::size_t n_keys_old = offsets.size() - 1;
+  assert(n_keys >= n_keys_old);
+  std::vector<std::size_t> offsets_new(n_keys + 1, 0);
+  for (std::size_t key = 0; key < n_keys_old; key++) {
+    offsets_new[key + 1] = offsets[key + 1] - offsets[key];
   }
+  for (const auto& entry : entries) offsets_new[entry.first + 1]++;
+  for (std::size_t key = 0; key < n_keys; key++) offsets_new[key + 1] += offsets_new[key];
+
+  std::vector<UnsignedInt> det_ids_new(offsets_new.back());
+  std::vector<std::size_t> positions(offsets_new.begin(), offsets_new.end() - 1);
+  for (std::size_t key = 0; key < n_keys_old; key++) {
+    for (std::size_t k = offsets[key]; k < offsets[key + 1]; k++) {
+      det_ids_new[positions[key]++] = det_ids[k];
+    }
+  }
+  for (const auto& entry : entries) det_ids_new[positions[entry.first]++] = entry.second;
+  offsets.swap(offsets_new);
+  det_ids.swap(det_ids_new);
 }
 
-void HelperStrings::setup_ab_m1() {
-  for (std::size_t i = Parallel::get_id(); i < dets.size(); i += Parallel::get_n()) {
-    const auto& up_elecs = dets[i].up.get_elec_orbs();
-    SpinDet det_up(dets[i].up);
-    for (std::size_t j = 0; j < up_elecs.size(); j++) {
-      det_up.set_orb(up_elecs[j], false);
-      ab_m1[det_up.encode()].first.push_back(i);
-      det_up.set_orb(up_elecs[j], true);
+void HelperStrings::update() {
+  const std::size_t n_dets = wf.size();
+  if (string_m1_offsets.empty()) string_m1_offsets.push_back(0);
+
+  // m1 strings of the new strings.
+  for (std::size_t string_id = get_n_strings(); string_id < wf.get_n_strings(); string_id++) {
+    const Orbitals& string = wf.get_string(static_cast<UnsignedInt>(string_id));
+    if (!string.empty()) {
+      // Remove the electrons one by one.
+      Orbitals m1_string(string.begin() + 1, string.end());
+      for (std::size_t k = 0; k < string.size(); k++) {
+        if (k > 0) m1_string[k - 1] = string[k - 1];
+        string_m1_ids.push_back(get_m1_string_id(m1_string));
+      }
     }
+    string_m1_offsets.push_back(string_m1_ids.size());
+  }
 
-    const auto& dn_elecs = dets[i].dn.get_elec_orbs();
-    SpinDet det_dn(dets[i].dn);
-    for (std::size_t j = 0; j < dn_elecs.size(); j++) {
-      det_dn.set_orb(dn_elecs[j], false);
-      ab_m1[det_dn.encode()].second.push_back(i);
-      det_dn.set_orb(dn_elecs[j], true);
+  // Index entries of the new dets striped to this process.
+  std::vector<std::pair<UnsignedInt, UnsignedInt>> up_entries;
+  std::vector<std::pair<UnsignedInt, UnsignedInt>> dn_entries;
+  std::vector<std::pair<UnsignedInt, UnsignedInt>> up_m1_entries;
+  std::vector<std::pair<UnsignedInt, UnsignedInt>> dn_m1_entries;
+  for (std::size_t i = n_dets_indexed; i < n_dets; i++) {
+    if (!is_owned(i)) continue;
+    const UnsignedInt up_id = wf.get_up_id(i);
+    const UnsignedInt dn_id = wf.get_dn_id(i);
+    const UnsignedInt det_id = static_cast<UnsignedInt>(i);
+    up_entries.push_back(std::make_pair(up_id, det_id));
+    dn_entries.push_back(std::make_pair(dn_id, det_id));
+    for (std::size_t k = string_m1_offsets[up_id]; k < string_m1_offsets[up_id + 1]; k++) {
+      up_m1_entries.push_back(std::make_pair(string_m1_ids[k], det_id));
+    }
+    for (std::size_t k = string_m1_offsets[dn_id]; k < string_m1_offsets[dn_id + 1]; k++) {
+      dn_m1_entries.push_back(std::make_pair(string_m1_ids[k], det_id));
     }
   }
+  up_dets.extend(up_entries, get_n_strings());
+  dn_dets.extend(dn_entries, get_n_strings());
+  up_m1_dets.extend(up_m1_entries, m1_string_ids.size());
+  dn_m1_dets.extend(dn_m1_entries, m1_string_ids.size());
+
+  n_dets_indexed = n_dets;
 }
 
-UnsignedInts HelperStrings::find_potential_connections(const std::size_t i) {
-  return find_potential_connections(dets[i]);
+UnsignedInt HelperStrings::get_m1_string_id(const Orbitals& m1_string) {
+  const auto& it = m1_string_ids.find(m1_string);
+  if (it != m1_string_ids.end()) return it->second;
+  const UnsignedInt m1_string_id = static_cast<UnsignedInt>(m1_string_ids.size());
+  m1_string_ids[m1_string] = m1_string_id;
+  return m1_string_id;
 }
 
-UnsignedInts HelperStrings::find_potential_connections(const Det& det) {
+void HelperStrings::find_m1_string_ids(
+    const Orbitals& string, std::vector<UnsignedInt>& m1_ids) const {
+  m1_ids.clear();
+  if (string.empty()) return;
+  Orbitals m1_string(string.begin() + 1, string.end());
+  for (std::size_t k = 0; k < string.size(); k++) {
+    if (k > 0) m1_string[k - 1] = string[k - 1];
+    const auto& it = m1_string_ids.find(m1_string);
+    m1_ids.push_back(it == m1_string_ids.end() ? NOT_FOUND : it->second);
+  }
+}
+
+UnsignedInts HelperStrings::find_potential_connections(
+    const std::size_t i, Scratch& scratch, const bool spin_flip) const {
   UnsignedInts connections;
-  const auto& up_elecs = det.up.get_elec_orbs();
-  const auto& dn_elecs = det.dn.get_elec_orbs();
+  const UnsignedInt up_id = wf.get_up_id(i);
+  const UnsignedInt dn_id = wf.get_dn_id(i);
+  const UnsignedInt* m1_ids = string_m1_ids.data();
+  const UnsignedInt* up_m1_ids_begin = m1_ids + string_m1_offsets[up_id];
+  const UnsignedInt* up_m1_ids_end = m1_ids + string_m1_offsets[up_id + 1];
+  const UnsignedInt* dn_m1_ids_begin = m1_ids + string_m1_offsets[dn_id];
+  const UnsignedInt* dn_m1_ids_end = m1_ids + string_m1_offsets[dn_id + 1];
+  add_potential_connections(
+      up_id,
+      dn_id,
+      up_m1_ids_begin,
+      up_m1_ids_end,
+      dn_m1_ids_begin,
+      dn_m1_ids_end,
+      scratch,
+      connections);
+
+  // Up and dn strings share the ids, so the flipped det swaps them.
+  if (spin_flip && up_id != dn_id) {
+    add_potential_connections(
+        dn_id,
+        up_id,
+        dn_m1_ids_begin,
+        dn_m1_ids_end,
+        up_m1_ids_begin,
+        up_m1_ids_end,
+        scratch,
+        connections);
+  }
+  reset_connected(connections, scratch);
+  return connections;
+}
+
+UnsignedInts HelperStrings::find_potential_connections(
+    const Det& det, Scratch& scratch) const {
+  // Absent strings get ids past the lists, which are empty there.
+  const UnsignedInt up_id = wf.find_string_id(det.up.get_elec_orbs());
+  const UnsignedInt dn_id = wf.find_string_id(det.dn.get_elec_orbs());
+  std::vector<UnsignedInt> up_m1_ids;
+  std::vector<UnsignedInt> dn_m1_ids;
+  find_m1_string_ids(det.up.get_elec_orbs(), up_m1_ids);
+  find_m1_string_ids(det.dn.get_elec_orbs(), dn_m1_ids);
+  UnsignedInts connections;
+  add_potential_connections(
+      up_id,
+      dn_id,
+      up_m1_ids.data(),
+      up_m1_ids.data() + up_m1_ids.size(),
+      dn_m1_ids.data(),
+      dn_m1_ids.data() + dn_m1_ids.size(),
+      scratch,
+      connections);
+  reset_connected(connections, scratch);
+  return connections;
+}
+
+void HelperStrings::add_potential_connections(
+    const UnsignedInt up_id,
+    const UnsignedInt dn_id,
+    const UnsignedInt* up_m1_ids_begin,
+    const UnsignedInt* up_m1_ids_end,
+    const UnsignedInt* dn_m1_ids_begin,
+    const UnsignedInt* dn_m1_ids_end,
+    Scratch& scratch,
+    UnsignedInts& connections) const {
+  auto& connected = scratch.connected;
+  auto& one_up = scratch.one_up;
+  auto& one_ups = scratch.one_ups;
+  if (connected.size() < n_dets_indexed) {
+    connected.resize(n_dets_indexed, false);
+    one_up.resize(n_dets_indexed, false);
+  }
 
   // Two up/dn excitations.
-  if (ab.find(det.dn.encode()) != ab.end()) {
-    for (const std::size_t det_id : ab.find(det.dn.encode())->second.second) {
-      if (!connected[det_id]) {
-        connected[det_id] = true;
-        connections.push_back(det_id);
-      }
+  for (const UnsignedInt* it = dn_dets.begin(dn_id); it != dn_dets.end(dn_id); it++) {
+    const UnsignedInt det_id = *it;
+    if (!connected[det_id]) {
+      connected[det_id] = true;
+      connections.push_back(det_id);
     }
   }
-  if (ab.find(det.up.encode()) != ab.end()) {
-    for (const std::size_t det_id : ab.find(det.up.encode())->second.first) {
-      if (!connected[det_id]) {
-        connected[det_id] = true;
-        connections.push_back(det_id);
-      }
+  for (const UnsignedInt* it = up_dets.begin(up_id); it != up_dets.end(up_id); it++) {
+    const UnsignedInt det_id = *it;
+    if (!connected[det_id]) {
+      connected[det_id] = true;
+      connections.push_back(det_id);
     }
   }
 
   // One up one dn excitation.
-  SpinDet det_up(det.up);
-  SpinDet det_dn(det.dn);
-  std::vector<std::size_t> one_ups;
-
-  for (std::size_t i = 0; i < up_elecs.size(); i++) {
-    det_up.set_orb(up_elecs[i], false);
-    const auto& key_up = det_up.encode();
-    const auto& kv_up = ab_m1.find(key_up);
-    if (kv_up != ab_m1.end()) {
-      for (const std::size_t det_id : kv_up->second.first) {
-        one_up[det_id] = true;
-        one_ups.push_back(det_id);
-      }
+  one_ups.clear();
+  for (const UnsignedInt* m1_id = up_m1_ids_begin; m1_id != up_m1_ids_end; m1_id++) {
+    for (const UnsignedInt* it = up_m1_dets.begin(*m1_id); it != up_m1_dets.end(*m1_id); it++) {
+      one_up[*it] = true;
+      one_ups.push_back(*it);
     }
-    det_up.set_orb(up_elecs[i], true);
   }
-
-  for (std::size_t j = 0; j < dn_elecs.size(); j++) {
-    det_dn.set_orb(dn_elecs[j], false);
-    const auto& key_dn = det_dn.encode();
-    if (ab_m1.find(key_dn) != ab_m1.end()) {
-      for (const std::size_t det_id : ab_m1.find(key_dn)->second.second) {
-        if (one_up[det_id] && !connected[det_id]) {
-          connected[det_id] = true;
-          connections.push_back(det_id);
-        }
+  for (const UnsignedInt* m1_id = dn_m1_ids_begin; m1_id != dn_m1_ids_end; m1_id++) {
+    for (const UnsignedInt* it = dn_m1_dets.begin(*m1_id); it != dn_m1_dets.end(*m1_id); it++) {
+      const UnsignedInt det_id = *it;
+      if (one_up[det_id] && !connected[det_id]) {
+        connected[det_id] = true;
+        connections.push_back(det_id);
       }
     }
-    det_dn.set_orb(dn_elecs[j], true);
   }
 
-  // Reset connected and return.
-  for (const std::size_t det_id : one_ups) one_up[det_id] = false;
-  for (const std::size_t det_id : connections) connected[det_id] = false;
-  return connections;
+  for (const UnsignedInt det_id : one_ups) one_up[det_id] = false;
+}
+
+void HelperStrings::reset_connected(const UnsignedInts& connections, Scratch& scratch) {
+  for (const UnsignedInt det_id : connections) scratch.connected[det_id] = false;
 }
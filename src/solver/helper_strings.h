@@ -6,42 +6,110 @@
 
 #include "../det/det.h"
 #include "../det/spin_det.h"
+#include "../parallel.h"
 #include "../types.h"
+#include "../wavefunction/wavefunction.h"
+
+// Lists of det ids keyed by dense ids, stored back to back in one array.
+class DetIdLists {
+ public:
+  DetIdLists() { offsets.push_back(0); }
+
+  // Add (key, det id) entries in one linear pass, keeping the existing ids in front.
+  void extend(const std::vector<std::pair<UnsignedInt, UnsignedInt>>& entries, std::size_t n_keys);
+
+  const UnsignedInt* begin(const UnsignedInt key) const { return get_list(key, 0); }
+
+  const UnsignedInt* end(const UnsignedInt key) const { return get_list(key, 1); }
+
+ private:
+  std::vector<std::size_t> offsets;
+  std::vector<UnsignedInt> det_ids;
+
+  const UnsignedInt* get_list(const UnsignedInt key, const std::size_t end) const {
+    if (key >= offsets.size() - 1) return det_ids.data();
+    return det_ids.data() + offsets[key + end];
+  }
+};
 
 class HelperStrings {
  public:
-  HelperStrings(const std::vector<Det>& dets) : dets(dets) {
-    setup_ab();
-    setup_ab_m1();
-    connected.assign(dets.size(), false);
-    one_up.assign(dets.size(), false);
+  // Working state of the queries, owned by the caller so that threads can query concurrently
+  // with one scratch each. Sized to the indexed dets on first use.
+  class Scratch {
+   public:
+    // Whether has been included in the potential connections.
+    std::vector<bool> connected;
+
+    // Whether the variational dets are one-up excitations of the det passed in.
+    std::vector<bool> one_up;
+
+    std::vector<UnsignedInt> one_ups;
+  };
+
+  // Index of the dets of wf by the string ids of wf, which must outlive it. Only the lists of the
+  // dets striped to this process are kept, the dets themselves are read from wf.
+  HelperStrings(const Wavefunction& wf) : wf(wf), n_dets_indexed(0) { update(); }
+
+  // Index the dets appended to wf since the last update.
+  void update();
+
+  std::size_t get_n_dets() const { return n_dets_indexed; }
+
+  std::size_t get_n_strings() const { return string_m1_offsets.size() - 1; }
+
+  // Whether the det is in the lists of this process, i.e. a potential connection found here.
+  static bool is_owned(const std::size_t i) {
+    return i % static_cast<std::size_t>(Parallel::get_n()) ==
+           static_cast<std::size_t>(Parallel::get_id());
   }
 
-  UnsignedInts find_potential_connections(const std::size_t i);
+  // With spin_flip, also the potential connections of det i with its spins swapped.
+  UnsignedInts find_potential_connections(
+      const std::size_t i, Scratch& scratch, const bool spin_flip = false) const;
 
-  UnsignedInts find_potential_connections(const Det& det);
+  UnsignedInts find_potential_connections(const Det& det, Scratch& scratch) const;
 
  private:
-  // alpha and beta strings, O(n_dets).
-  std::unordered_map<Orbitals, std::pair<UnsignedInts, UnsignedInts>, boost::hash<Orbitals>> ab;
+  static const UnsignedInt NOT_FOUND;
+
+  const Wavefunction& wf;
+
+  // Dense ids of the spin strings with one electron removed.
+  std::unordered_map<Orbitals, UnsignedInt, boost::hash<Orbitals>> m1_string_ids;
+
+  // m1 string ids of each string of wf, one per electron, O(n_strings * n_elecs).
+  std::vector<std::size_t> string_m1_offsets;
+  std::vector<UnsignedInt> string_m1_ids;
+
+  // Dets indexed by this process, by up / dn string, O(n_dets).
+  DetIdLists up_dets;
+  DetIdLists dn_dets;
 
-  // alpha-m1 and beta-m1 strings, O(n_dets * n_elecs).
-  std::unordered_map<Orbitals, std::pair<UnsignedInts, UnsignedInts>, boost::hash<Orbitals>> ab_m1;
+  // Dets indexed by this process, by the m1 strings of up / dn, O(n_dets * n_elecs).
+  DetIdLists up_m1_dets;
+  DetIdLists dn_m1_dets;
 
-  // Variational determinants.
-  const std::vector<Det> dets;
+  // Number of leading dets already in the strings.
+  std::size_t n_dets_indexed;
 
-  // Whether has been included in the potential connections.
-  std::vector<bool> connected;
+  UnsignedInt get_m1_string_id(const Orbitals& m1_string);
 
-  // Whether the variational dets are one-up excitations of the det passed in.
-  std::vector<bool> one_up;
+  // m1 string ids of the string, looked up without assigning new ones.
+  void find_m1_string_ids(const Orbitals& string, std::vector<UnsignedInt>& m1_ids) const;
 
-  // Setup alpha and beta.
-  void setup_ab();
+  // Append the connections not yet marked in the scratch, leaving them marked.
+  void add_potential_connections(
+      const UnsignedInt up_id,
+      const UnsignedInt dn_id,
+      const UnsignedInt* up_m1_ids_begin,
+      const UnsignedInt* up_m1_ids_end,
+      const UnsignedInt* dn_m1_ids_begin,
+      const UnsignedInt* dn_m1_ids_end,
+      Scratch& scratch,
+      UnsignedInts& connections) const;
 
-  // Setup alpha-m1 and beta-m1.
-  void setup_ab_m1();
+  static void reset_connected(const UnsignedInts& connections, Scratch& scratch);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -4,7 +4,7 @@
 #include "../parallel.h"
 
 TEST(HelperStringsTest, SetupAndFindConnections) {
-  std::vector<Det> dets;
+  Wavefunction wf;
   Det det1, det2, det3;
   det1.up.set_orb(1, true);
   det1.up.set_orb(2, true);
@@ -18,16 +18,46 @@ TEST(HelperStringsTest, SetupAndFindConnections) {
   det3.up.set_orb(4, true);
   det3.dn.set_orb(5, true);
   det3.dn.set_orb(6, true);
-  dets.push_back(det1);
-  dets.push_back(det2);
-  dets.push_back(det3);
+  wf.append_term(det1, 1.0);
+  wf.append_term(det2, 0.0);
+  wf.append_term(det3, 0.0);
 
   boost::mpi::environment env;
   Parallel::init(env);
-  HelperStrings hs(dets);
-  const auto& connections = hs.find_potential_connections(0);
+  HelperStrings hs(wf);
+  HelperStrings::Scratch scratch;
+  const auto& connections = hs.find_potential_connections(0, scratch);
   EXPECT_EQ(connections.size(), 2);
   EXPECT_TRUE(std::find(connections.begin(), connections.end(), 0) != connections.end());
   EXPECT_TRUE(std::find(connections.begin(), connections.end(), 1) != connections.end());
   EXPECT_TRUE(std::find(connections.begin(), connections.end(), 2) == connections.end());
-}
\ No newline at end of file
+
+  // Dets appended later are found after an update.
+  Det det4 = det1;
+  det4.dn.set_orb(2, false);
+  det4.dn.set_orb(3, true);
+  wf.append_term(det4, 0.0);
+  hs.update();
+  const auto& connections_updated = hs.find_potential_connections(0, scratch);
+  EXPECT_EQ(hs.get_n_dets(), 4);
+  EXPECT_EQ(hs.get_n_strings(), 4);
+  EXPECT_EQ(connections_updated.size(), 3);
+  EXPECT_TRUE(
+      std::find(connections_updated.begin(), connections_updated.end(), 3) !=
+      connections_updated.end());
+
+  // The flipped det of det5 shares the dn string of det3.
+  Det det5;
+  det5.up.set_orb(5, true);
+  det5.up.set_orb(6, true);
+  det5.dn.set_orb(7, true);
+  det5.dn.set_orb(8, true);
+  wf.append_term(det5, 0.0);
+  hs.update();
+  EXPECT_EQ(hs.find_potential_connections(4, scratch).size(), 1);
+  const auto& connections_flipped = hs.find_potential_connections(4, scratch, true);
+  EXPECT_EQ(connections_flipped.size(), 2);
+  EXPECT_TRUE(
+      std::find(connections_flipped.begin(), connections_flipped.end(), 2) !=
+      connections_flipped.end());
+}
@@ -1,12 +1,20 @@
 #include "solver.h"
 
-#include <boost/functional/hash.hpp>
-
+#include "../compensated_double.h"
+#include "../config.h"
 #include "../det/det.h"
+#include "../det/excitation.h"
 #include "../parallel.h"
 #include "../time/time.h"
 #include "diagonalization/davidson.h"
 #include "helper_strings.h"
+#include "sparse_matrix.h"
+
+// Per-process budget in MB of the cached hamiltonian, 0 to evaluate it on the fly in every product.
+static std::size_t get_hamiltonian_cache_mb() {
+  const std::size_t HAMILTONIAN_CACHE_MB_DEFAULT = 0;
+  return Config::get<std::size_t>("hamiltonian_cache_mb", HAMILTONIAN_CACHE_MB_DEFAULT);
+}
 
 Det Solver::generate_hf_det() {
   Det det;
@@ -15,46 +23,108 @@ Det Solver::generate_hf_det() {
   return det;
 }
 
+double Solver::hamiltonian_basis(
+    const Det& det_i, const Det& det_j, Det& det_flipped, Excitation& excitation) const {
+  // The off-diagonal elements come from the excitations already analyzed here.
+  const auto& get_element = [&](const Det& det) {
+    excitation.from_dets(det_i, det);
+    const std::size_t degree = excitation.get_degree();
+    if (degree == 0) return hamiltonian(det_i, det);
+    return degree <= 2 ? hamiltonian(excitation) : 0.0;
+  };
+
+  // H between the combinations from the flip symmetry of H: <i|H|j> + <i|H|flipped j> scaled by
+  // sqrt(n_partners_i / n_partners_j). The excitation is left at the one from det_i to det_j.
+  double H = 0.0;
+  const std::size_t n_partners_i = get_n_partners(det_i);
+  const std::size_t n_partners_j = get_n_partners(det_j);
+  if (n_partners_j == 2) {
+    det_flipped.up = det_j.dn;
+    det_flipped.dn = det_j.up;
+    H += get_element(det_flipped);
+  }
+  H += get_element(det_j);
+  if (n_partners_i > n_partners_j) {
+    H *= M_SQRT2;
+  } else if (n_partners_i < n_partners_j) {
+    H *= M_SQRT1_2;
+  }
+  return H;
+}
+
+// Sum over processes as pairs of plain doubles and round the compensated values.
+static std::vector<double> reduce_compensated(const std::vector<CompensatedDouble>& res_compensated) {
+  const std::size_t n = res_compensated.size();
+  std::vector<double> res_parts(n * 2);
+  for (std::size_t i = 0; i < n; i++) {
+    res_parts[i * 2] = res_compensated[i].get_sum();
+    res_parts[i * 2 + 1] = res_compensated[i].get_compensation();
+  }
+  Parallel::reduce_to_sum(res_parts);
+  std::vector<double> res(n);
+  for (std::size_t i = 0; i < n; i++) res[i] = res_parts[i * 2] + res_parts[i * 2 + 1];
+  return res;
+}
+
 std::vector<double> Solver::apply_hamiltonian(
     const std::vector<double>& vec, HelperStrings& helper_strings) {
+  const std::size_t ROWS_PER_BLOCK = 4096;
   std::size_t n = vec.size();
   assert(n == wf.size());
-  std::vector<double> res(n, 0.0);
-  std::vector<long double> res_precise(n, 0.0);
-  const auto& dets = wf.get_dets();
+  std::vector<CompensatedDouble> res_compensated(n, 0.0);
   unsigned long long n_connections = 0;
   static unsigned long long n_connections_prev = 0;
   unsigned long long same_spin_count = 0, opposite_spin_count = 0;
 
-  for (std::size_t i = 0; i < n; i++) {
-    // if (i % Parallel::get_n() != static_cast<std::size_t>(Parallel::get_id())) continue;
-    const Det& det_i = dets[i];
-    auto connections = helper_strings.find_potential_connections(i);
-    for (std::size_t j : connections) {
-      if (j < i) continue;
-      const Det& det_j = dets[j];
-      const double H_ij = hamiltonian(det_i, det_j);
-      if (H_ij == 0) continue;
-      if (det_i.up == det_j.up || det_i.dn == det_j.dn) {
-        same_spin_count++;
-      } else {
-        opposite_spin_count++;
+  // Each pair i <= j is evaluated once, block by block as in extend_hamiltonian_matrix. The
+  // threads add H_ij vec[j] to their own rows i and keep the H_ij vec[i] for the rows j, which
+  // are then scattered in row order, so the result does not depend on the number of threads.
+  std::vector<std::vector<std::pair<UnsignedInt, double>>> block_scatters(ROWS_PER_BLOCK);
+  for (std::size_t block_begin = 0; block_begin < n; block_begin += ROWS_PER_BLOCK) {
+    const std::size_t block_end = std::min(block_begin + ROWS_PER_BLOCK, n);
+#pragma omp parallel reduction(+ : n_connections, same_spin_count, opposite_spin_count)
+    {
+      HelperStrings::Scratch scratch;
+      Excitation excitation;
+      Det det_i;
+      Det det_j;
+      Det det_flipped;
+#pragma omp for schedule(dynamic, 16)
+      for (std::size_t i = block_begin; i < block_end; i++) {
+        auto& scatter = block_scatters[i - block_begin];
+        scatter.clear();
+        // Rows are any dets, the connections are the dets striped to this process.
+        wf.get_det(i, det_i);
+        auto connections =
+            helper_strings.find_potential_connections(i, scratch, spin_flip_symmetry);
+        for (std::size_t j : connections) {
+          if (j < i) continue;
+          wf.get_det(j, det_j);
+          const double H_ij = hamiltonian_basis(det_i, det_j, det_flipped, excitation);
+          if (H_ij == 0) continue;
+          if (excitation.n_up == 0 || excitation.n_dn == 0) {
+            same_spin_count++;
+          } else {
+            opposite_spin_count++;
+          }
+          res_compensated[i] += H_ij * vec[j];
+          if (i != j) {
+            scatter.push_back(std::make_pair(static_cast<UnsignedInt>(j), H_ij * vec[i]));
+            n_connections += 2;
+          } else {
+            n_connections++;
+          }
+        }
       }
-      res_precise[i] += H_ij * vec[j];
-      if (i != j) {
-        res_precise[j] += H_ij * vec[i];
-        n_connections += 2;
-      } else {
-        n_connections++;
+    }
+    for (std::size_t i = block_begin; i < block_end; i++) {
+      for (const auto& elem : block_scatters[i - block_begin]) {
+        res_compensated[elem.first] += elem.second;
       }
     }
   }
   Time::checkpoint("Diagonalization", "hamiltonian applied");
-#ifdef __INTEL_COMPILER
-  for (std::size_t i = 0; i < n; i++) Parallel::reduce_to_sum(res_precise[i]);
-#else
-  Parallel::reduce_to_sum(res_precise);
-#endif
+  std::vector<double> res = reduce_compensated(res_compensated);
   Parallel::reduce_to_sum(n_connections);
   Parallel::reduce_to_sum(same_spin_count);
   Parallel::reduce_to_sum(opposite_spin_count);
@@ -63,10 +133,74 @@ std::vector<double> Solver::apply_hamiltonian(
     printf("Number of connections: %'llu\n", n_connections);
     n_connections_prev = n_connections;
   }
-  for (std::size_t i = 0; i < n; i++) res[i] = static_cast<double>(res_precise[i]);
   return res;
 }
 
+std::vector<double> Solver::apply_hamiltonian(
+    const std::vector<double>& vec, const SparseMatrix& hamiltonian_matrix) {
+  std::size_t n = vec.size();
+  assert(n == wf.size());
+  std::vector<CompensatedDouble> res_compensated(n, 0.0);
+  hamiltonian_matrix.multiply_symmetric(vec, res_compensated);
+  Time::checkpoint("Diagonalization", "hamiltonian applied");
+  return reduce_compensated(res_compensated);
+}
+
+bool Solver::extend_hamiltonian_matrix(
+    HelperStrings& helper_strings, SparseMatrix& hamiltonian_matrix, const std::size_t max_n_bytes) {
+  const std::size_t ROWS_PER_BLOCK = 4096;
+  const std::size_t n = wf.size();
+  bool is_over_budget = SparseMatrix::get_n_bytes(n, 0) > max_n_bytes;
+
+  // Rows are evaluated by the threads block by block, then appended in order.
+  std::vector<std::vector<std::pair<UnsignedInt, double>>> block_rows(ROWS_PER_BLOCK);
+  std::size_t block_begin = hamiltonian_matrix.get_n_rows();
+  while (block_begin < n && !is_over_budget) {
+    const std::size_t block_end = std::min(block_begin + ROWS_PER_BLOCK, n);
+#pragma omp parallel
+    {
+      HelperStrings::Scratch scratch;
+      Excitation excitation;
+      Det det_i;
+      Det det_j;
+      Det det_flipped;
+#pragma omp for schedule(dynamic, 16)
+      for (std::size_t j = block_begin; j < block_end; j++) {
+        auto& row = block_rows[j - block_begin];
+        row.clear();
+        wf.get_det(j, det_j);
+        auto connections =
+            helper_strings.find_potential_connections(j, scratch, spin_flip_symmetry);
+        for (std::size_t i : connections) {
+          if (i > j) continue;
+          wf.get_det(i, det_i);
+          const double H_ij = hamiltonian_basis(det_i, det_j, det_flipped, excitation);
+          if (H_ij == 0) continue;
+          row.push_back(std::make_pair(static_cast<UnsignedInt>(i), H_ij));
+        }
+      }
+    }
+    for (std::size_t j = block_begin; j < block_end; j++) {
+      for (const auto& elem : block_rows[j - block_begin]) {
+        hamiltonian_matrix.append_elem(elem.first, elem.second);
+      }
+      hamiltonian_matrix.end_row();
+    }
+    is_over_budget = SparseMatrix::get_n_bytes(n, hamiltonian_matrix.get_n_elems()) > max_n_bytes;
+    block_begin = block_end;
+  }
+
+  // Cache on all processes or none, so that they take the same path in apply_hamiltonian.
+  int n_over_budget = is_over_budget ? 1 : 0;
+  Parallel::reduce_to_sum(n_over_budget);
+  if (n_over_budget > 0) {
+    hamiltonian_matrix.clear();
+    return false;
+  }
+  hamiltonian_matrix.update_transpose();
+  return true;
+}
+
 void Solver::variation() {
   const double THRESHOLD = 1.0e-6;
 
@@ -80,35 +214,35 @@ void Solver::variation() {
 
   double energy_var_new = 0.0;  // Ensures the first iteration will run.
   var_dets_set.clear();
-  for (const auto& term : wf.get_terms()) var_dets_set.insert(term.det.encode());
+  var_dets_set.reserve(wf.size());
+  Det det;
+  for (std::size_t i = 0; i < wf.size(); i++) {
+    wf.get_det(i, det);
+    var_dets_set.insert(det);
+  }
+
+  // Dets keep their order within the iterations, so that the helper strings and the cached
+  // hamiltonian only need to be extended with the rows of the new dets.
+  HelperStrings helper_strings(wf);
+  SparseMatrix hamiltonian_matrix;
+  bool is_hamiltonian_cached = get_hamiltonian_cache_mb() > 0;
   int iteration = 0;  // For print.
   while (fabs(energy_var - energy_var_new) > THRESHOLD) {
     Time::start("Variation Iteration: " + std::to_string(iteration));
 
     // Find connected determinants.
-    std::list<Det> new_dets;
-    std::unordered_set<OrbitalsPair, boost::hash<OrbitalsPair>> new_dets_set;
-    for (const auto& term : wf.get_terms()) {
-      const auto& connected_dets = find_connected_dets(term.det, eps_var / fabs(term.coef));
-      for (const auto& new_det : connected_dets) {
-        if (var_dets_set.count(new_det.encode()) == 0 &&
-            new_dets_set.count(new_det.encode()) == 0) {
-          new_dets_set.insert(new_det.encode());
-          new_dets.push_back(new_det);
-        }
-      }
-    }
-
+    std::list<Det> new_dets = find_next_dets();
+    Time::checkpoint("Variation Iteration: " + std::to_string(iteration), "new dets found");
     if (Parallel::get_id() == 0) {
       printf("Number of new dets: %'llu\n", static_cast<BigUnsignedInt>(new_dets.size()));
     }
 
-    new_dets_set.clear();
     // const auto& filtered_dets = filter_dets(new_dets, eps_var);
     const auto filtered_dets = new_dets;
     new_dets.clear();
+    wf.reserve(wf.size() + filtered_dets.size());
     for (const auto& filtered_det : filtered_dets) {
-      var_dets_set.insert(filtered_det.encode());
+      var_dets_set.insert(filtered_det);
       wf.append_term(filtered_det, 0.0);
     }
     if (Parallel::get_id() == 0) {
@@ -117,30 +251,118 @@ void Solver::variation() {
     }
 
     energy_var = energy_var_new;
-    energy_var_new = diagonalize(filtered_dets.size() > 0 ? 5 : 10);
+    helper_strings.update();
+    energy_var_new = diagonalize(
+        filtered_dets.size() > 0 ? 5 : 10,
+        helper_strings,
+        hamiltonian_matrix,
+        is_hamiltonian_cached);
     if (Parallel::get_id() == 0) printf("Variation energy: %#.15g Ha\n", energy_var_new);
     Time::end("Variation Iteration: " + std::to_string(iteration));
     iteration++;
   }
 
   energy_var = energy_var_new;
+  wf.sort_by_coefs();
   if (Parallel::get_id() == 0) printf("Final variation energy: %#.15g Ha\n", energy_var);
 }
 
+std::list<Det> Solver::find_next_dets() {
+  const std::size_t n = wf.size();
+  const std::size_t proc_id = Parallel::get_id();
+  const std::size_t n_procs = Parallel::get_n();
+  const auto& coefs = wf.get_coefs();
+
+  // Candidates from the dets striped to this process, each tagged with the det index and its
+  // position among the excitations of that det. A thread visits its dets in increasing order,
+  // so keeping only its first copy of a candidate keeps its smallest tag.
+  const int n_threads = Parallel::get_n_threads();
+  std::vector<std::vector<BigUnsignedInt>> tags_threads(n_threads);
+  std::vector<Orbitals> orbs_threads(n_threads);
+#pragma omp parallel num_threads(n_threads)
+  {
+    const int thread_id = Parallel::get_thread_id();
+    auto& tags = tags_threads[thread_id];
+    auto& orbs = orbs_threads[thread_id];
+    DetSet candidates_set;
+    Det det_i;
+    Det new_det;
+#pragma omp for schedule(dynamic, 16)
+    for (std::size_t i = proc_id; i < n; i += n_procs) {
+      BigUnsignedInt position = 0;
+      wf.get_det(i, det_i);
+      const auto& new_det_handler = [&](const Excitation& excitation, const double) {
+        position++;
+        new_det = det_i;
+        excitation.apply_to(new_det);
+        if (spin_flip_symmetry && !new_det.is_spin_flip_canonical()) new_det.flip_spins();
+        if (var_dets_set.count(new_det) != 0 || !candidates_set.insert(new_det)) return;
+        tags.push_back(i);
+        tags.push_back(position);
+        const auto& up_elecs = new_det.up.get_elec_orbs();
+        const auto& dn_elecs = new_det.dn.get_elec_orbs();
+        orbs.insert(orbs.end(), up_elecs.begin(), up_elecs.end());
+        orbs.insert(orbs.end(), dn_elecs.begin(), dn_elecs.end());
+      };
+      const double coef_i = get_det_coef(det_i, coefs[i]);
+      find_connected_excitations(det_i, eps_var / fabs(coef_i), new_det_handler);
+    }
+  }
+  for (int t = 1; t < n_threads; t++) {
+    tags_threads[0].insert(tags_threads[0].end(), tags_threads[t].begin(), tags_threads[t].end());
+    orbs_threads[0].insert(orbs_threads[0].end(), orbs_threads[t].begin(), orbs_threads[t].end());
+    std::vector<BigUnsignedInt>().swap(tags_threads[t]);
+    Orbitals().swap(orbs_threads[t]);
+  }
+
+  // Merge the candidates of all the processes by tag, keeping the first copy of each det.
+  std::vector<std::vector<BigUnsignedInt>> tags_procs;
+  std::vector<Orbitals> orbs_procs;
+  Parallel::all_gather(tags_threads[0], tags_procs);
+  Parallel::all_gather(orbs_threads[0], orbs_procs);
+  typedef std::pair<std::size_t, std::size_t> Candidate;  // (process, position).
+  std::vector<Candidate> order;
+  for (std::size_t p = 0; p < tags_procs.size(); p++) {
+    const std::size_t n_candidates = tags_procs[p].size() / 2;
+    for (std::size_t k = 0; k < n_candidates; k++) order.push_back(std::make_pair(p, k));
+  }
+  std::sort(
+      order.begin(), order.end(), [&](const Candidate& a, const Candidate& b) {
+        const BigUnsignedInt* tag_a = tags_procs[a.first].data() + a.second * 2;
+        const BigUnsignedInt* tag_b = tags_procs[b.first].data() + b.second * 2;
+        return tag_a[0] < tag_b[0] || (tag_a[0] == tag_b[0] && tag_a[1] < tag_b[1]);
+      });
+  std::list<Det> new_dets;
+  DetSet new_dets_set;
+  Det new_det;
+  const std::size_t n_elecs = n_up + n_dn;
+  for (const auto& candidate : order) {
+    const auto& elecs_begin = orbs_procs[candidate.first].begin() + candidate.second * n_elecs;
+    new_det.up.decode(Orbitals(elecs_begin, elecs_begin + n_up), SpinDet::FIXED);
+    new_det.dn.decode(Orbitals(elecs_begin + n_up, elecs_begin + n_elecs), SpinDet::FIXED);
+    if (new_dets_set.insert(new_det)) new_dets.push_back(new_det);
+  }
+  return new_dets;
+}
+
 std::list<Det> Solver::filter_dets(const std::list<Det>& new_dets, const double eps_var) {
   // Filter perturbation correction.
   Time::start("Filter");
-  std::vector<Det> dets = wf.get_dets();
-  std::vector<double> coefs = wf.get_coefs();
-  HelperStrings helper_strings(dets);
+  const auto& coefs = wf.get_coefs();
+  HelperStrings helper_strings(wf);
   std::list<Det> filtered_dets;
   Time::checkpoint("Filter", "helper strings generated");
+  HelperStrings::Scratch scratch;
+  Excitation excitation;
+  Det det_j;
   for (const Det& det_i : new_dets) {
     double pt_sum = 0.0;
-    auto connections = helper_strings.find_potential_connections(det_i);
+    auto connections = helper_strings.find_potential_connections(det_i, scratch);
     for (const auto& j : connections) {
-      const Det& det_j = dets[j];
-      const double H_ij = hamiltonian(det_i, det_j);
+      wf.get_det(j, det_j);
+      excitation.from_dets(det_i, det_j);
+      if (excitation.get_degree() > 2) continue;
+      const double H_ij = hamiltonian(excitation);  // New dets are not in wf.
       pt_sum += H_ij * coefs[j];
     }
     Parallel::reduce_to_sum(pt_sum);
@@ -151,21 +373,50 @@ std::list<Det> Solver::filter_dets(const std::list<Det>& new_dets, const double
   return filtered_dets;
 }
 
-double Solver::diagonalize(std::size_t max_iterations) {
-  std::vector<double> diagonal;
-  std::vector<double> initial_vector;
-  diagonal.reserve(wf.size());
-  initial_vector.reserve(wf.size());
-  for (const auto& term : wf.get_terms()) {
-    const auto& det = term.det;
-    diagonal.push_back(hamiltonian(det, det));
-    initial_vector.push_back(term.coef);
+double Solver::diagonalize(
+    const std::size_t max_iterations,
+    HelperStrings& helper_strings,
+    SparseMatrix& hamiltonian_matrix,
+    bool& is_hamiltonian_cached) {
+  const std::vector<double>& initial_vector = wf.get_coefs();
+  const std::size_t n = wf.size();
+  std::vector<double> diagonal(n);
+#pragma omp parallel
+  {
+    Det det_i;
+    Det det_flipped;
+    Excitation excitation;
+#pragma omp for schedule(static)
+    for (std::size_t i = 0; i < n; i++) {
+      wf.get_det(i, det_i);
+      diagonal[i] = hamiltonian_basis(det_i, det_i, det_flipped, excitation);
+    }
   }
   Time::start("Diagonalization");
-  HelperStrings helper_strings(wf.get_dets());
-  Time::checkpoint("Diagonalization", "helper strings generated");
-  std::function<std::vector<double>(std::vector<double>)> apply_hamiltonian_func =
-      std::bind(&Solver::apply_hamiltonian, this, std::placeholders::_1, helper_strings);
+
+  // Evaluate the local part of H for the new dets once for all the Davidson iterations,
+  // as long as it fits in memory.
+  std::function<std::vector<double>(std::vector<double>)> apply_hamiltonian_func;
+  if (is_hamiltonian_cached) {
+    is_hamiltonian_cached = extend_hamiltonian_matrix(
+        helper_strings, hamiltonian_matrix, get_hamiltonian_cache_mb() << 20);
+    if (!is_hamiltonian_cached && Parallel::get_id() == 0) {
+      printf("Hamiltonian exceeds the cache budget, evaluating on the fly.\n");
+    }
+  }
+  if (is_hamiltonian_cached) {
+    unsigned long long n_elems = hamiltonian_matrix.get_n_elems();
+    Parallel::reduce_to_sum(n_elems);
+    Time::checkpoint("Diagonalization", "hamiltonian cached");
+    if (Parallel::get_id() == 0) printf("Cached hamiltonian elements: %'llu\n", n_elems);
+    apply_hamiltonian_func = [&](const std::vector<double>& vec) {
+      return apply_hamiltonian(vec, hamiltonian_matrix);
+    };
+  } else {
+    apply_hamiltonian_func = [&](const std::vector<double>& vec) {
+      return apply_hamiltonian(vec, helper_strings);
+    };
+  }
 
   Davidson davidson(diagonal, apply_hamiltonian_func, wf.size());
   if (Parallel::get_id() == 0) davidson.set_verbose(true);
@@ -174,7 +425,6 @@ double Solver::diagonalize(std::size_t max_iterations) {
   double energy_var = davidson.get_lowest_eigenvalue();
   const auto& coefs_new = davidson.get_lowest_eigenvector();
   wf.set_coefs(coefs_new);
-  wf.sort_by_coefs();
 
   return energy_var;
 }
@@ -183,22 +433,24 @@ unsigned long long Solver::estimate_n_pt_dets(const double eps_pt) {
   const std::size_t SAMPLE_INTERVAL_MIN = 10;
   const std::size_t n = wf.size();
   unsigned long long estimation = 0;
-  auto it = wf.get_terms().begin();
+  const auto& coefs = wf.get_coefs();
   const std::size_t sample_interval = std::max(n / 1000, SAMPLE_INTERVAL_MIN);
-  std::unordered_set<OrbitalsPair, boost::hash<OrbitalsPair>> pt_dets_set;
+  DetSet pt_dets_set;
+  Det det_i;
+  Det det_a;
   for (std::size_t i = 0; i < n; i++) {
-    const auto& term = *it++;
     if ((i % (sample_interval * Parallel::get_n())) != sample_interval * Parallel::get_id()) {
       continue;
     }
-    const auto& connected_dets = find_connected_dets(term.det, eps_pt / fabs(term.coef));
-    for (const auto& det : connected_dets) {
-      const auto& code = det.encode();
-      if (var_dets_set.count(code) == 0 && pt_dets_set.count(code) == 0) {
-        estimation++;
-        pt_dets_set.insert(code);
-      }
-    }
+    wf.get_det(i, det_i);
+    const auto& pt_det_handler = [&](const Excitation& excitation, const double) {
+      det_a = det_i;
+      excitation.apply_to(det_a);
+      if (spin_flip_symmetry && !det_a.is_spin_flip_canonical()) det_a.flip_spins();
+      if (var_dets_set.count(det_a) == 0 && pt_dets_set.insert(det_a)) estimation++;
+    };
+    const double coef_i = get_det_coef(det_i, coefs[i]);
+    find_connected_excitations(det_i, eps_pt / fabs(coef_i), pt_det_handler);
   }
   estimation *= sample_interval;
   Parallel::reduce_to_sum(estimation);
@@ -4,11 +4,17 @@
 #include "../std.h"
 
 #include "../det/det.h"
+#include "../det/det_set.h"
+#include "../det/excitation.h"
 #include "../wavefunction/wavefunction.h"
 #include "helper_strings.h"
+#include "sparse_matrix.h"
 
 class Solver {
  protected:
+  // Receives each connected excitation and the upper bound of its |H|.
+  typedef std::function<void(const Excitation&, const double)> ExcitationHandler;
+
   std::size_t n_up;
   std::size_t n_dn;
   double max_abs_H;
@@ -19,7 +25,12 @@ class Solver {
   double energy_correlation;
   double eps_var;
   double eps_pt;
-  std::unordered_set<OrbitalsPair, boost::hash<OrbitalsPair>> var_dets_set;
+  DetSet var_dets_set;
+
+  // Keep only the canonical det of each spin flip pair, with n_up == n_dn. The wavefunction is
+  // then in the basis of the symmetric combinations, whose coefficients are those of the dets
+  // times the square root of the number of dets combined.
+  bool spin_flip_symmetry = false;
 
   virtual void solve() {
     setup();
@@ -31,22 +42,56 @@ class Solver {
 
   virtual double hamiltonian(const Det&, const Det&) const = 0;
 
-  virtual std::list<Det> find_connected_dets(const Det&, const double eps) const = 0;
+  // Off-diagonal element from the excitation between the dets, zero beyond double excitations.
+  virtual double hamiltonian(const Excitation&) const = 0;
+
+  // Number of dets the det stands for, 2 with spin flip symmetry unless up == dn.
+  template <class D>
+  std::size_t get_n_partners(const D& det) const {
+    return spin_flip_symmetry && !(det.up == det.dn) ? 2 : 1;
+  }
+
+  // Coefficient of the det itself from the coefficient of the basis function of the det.
+  double get_det_coef(const Det& det, const double coef) const {
+    return get_n_partners(det) == 2 ? coef * M_SQRT1_2 : coef;
+  }
+
+  // Element between the basis functions of the dets, either the dets themselves or, with spin
+  // flip symmetry, their symmetric combinations. Zero beyond double excitations.
+  double hamiltonian_basis(const Det&, const Det&, Det& det_flipped, Excitation&) const;
+
+  // Stream the excitations of det with |H| >= eps to handler, excluding det itself.
+  virtual void find_connected_excitations(
+      const Det&, const double eps, const ExcitationHandler& handler) const = 0;
 
   std::vector<double> apply_hamiltonian(const std::vector<double>&, HelperStrings&);
 
+  // With the cached local upper triangle of H instead of evaluating the elements.
+  std::vector<double> apply_hamiltonian(const std::vector<double>&, const SparseMatrix&);
+
+  // Append the rows of the dets not yet cached, holding the elements H_ij with i <= j.
+  // False and nothing cached if any process needs more than max_n_bytes.
+  bool extend_hamiltonian_matrix(HelperStrings&, SparseMatrix&, const std::size_t max_n_bytes);
+
   Det generate_hf_det();
 
   void variation();
 
   std::list<Det> filter_dets(const std::list<Det>&, const double eps);
 
-  double diagonalize(std::size_t);
+  // Davidson with the helper strings and the hamiltonian cache of the current dets.
+  double diagonalize(
+      const std::size_t max_iterations,
+      HelperStrings&,
+      SparseMatrix&,
+      bool& is_hamiltonian_cached);
 
   virtual void perturbation() {}
 
   unsigned long long estimate_n_pt_dets(const double);
 
+  // Dets connected to the wavefunction with |H * coef| >= eps_var and not yet in it, in the
+  // order of a serial scan over the dets and their excitations, on all the processes.
   std::list<Det> find_next_dets();
 };
 
@@ -0,0 +1,108 @@
+#ifndef HCI_SPARSE_MATRIX_H_
+#define HCI_SPARSE_MATRIX_H_
+
+#include "../std.h"
+
+#include "../types.h"
+
+// Compressed sparse rows holding one triangle of a symmetric matrix, plus a transposed copy of
+// its off-diagonal elements so that products only write to their own rows.
+// Rows are appended in order, each with its elements in any order, then the transpose is rebuilt.
+class SparseMatrix {
+ public:
+  SparseMatrix() {
+    row_offsets.push_back(0);
+    transpose_row_offsets.push_back(0);
+  }
+
+  void append_elem(const std::size_t col_id, const double value) {
+    col_ids.push_back(static_cast<UnsignedInt>(col_id));
+    values.push_back(value);
+  }
+
+  void end_row() { row_offsets.push_back(col_ids.size()); }
+
+  // Transpose the off-diagonal elements of the rows appended so far, in increasing row order.
+  void update_transpose() {
+    const std::size_t n_rows = get_n_rows();
+    transpose_row_offsets.assign(n_rows + 1, 0);
+    for (std::size_t i = 0; i < n_rows; i++) {
+      for (std::size_t k = row_offsets[i]; k < row_offsets[i + 1]; k++) {
+        if (col_ids[k] != i) transpose_row_offsets[col_ids[k] + 1]++;
+      }
+    }
+    for (std::size_t j = 0; j < n_rows; j++) {
+      transpose_row_offsets[j + 1] += transpose_row_offsets[j];
+    }
+    const std::size_t n_transpose_elems = transpose_row_offsets[n_rows];
+    transpose_col_ids.clear();
+    transpose_values.clear();
+    transpose_col_ids.shrink_to_fit();
+    transpose_values.shrink_to_fit();
+    transpose_col_ids.resize(n_transpose_elems);
+    transpose_values.resize(n_transpose_elems);
+    std::vector<std::size_t> positions(
+        transpose_row_offsets.begin(), transpose_row_offsets.end() - 1);
+    for (std::size_t i = 0; i < n_rows; i++) {
+      for (std::size_t k = row_offsets[i]; k < row_offsets[i + 1]; k++) {
+        const std::size_t j = col_ids[k];
+        if (j == i) continue;
+        transpose_col_ids[positions[j]] = static_cast<UnsignedInt>(i);
+        transpose_values[positions[j]] = values[k];
+        positions[j]++;
+      }
+    }
+  }
+
+  std::size_t get_n_rows() const { return row_offsets.size() - 1; }
+
+  std::size_t get_n_elems() const { return col_ids.size(); }
+
+  // Bytes needed for n_rows rows holding n_elems elements in total, with the transpose.
+  static std::size_t get_n_bytes(const std::size_t n_rows, const std::size_t n_elems) {
+    return (n_rows + 1) * sizeof(std::size_t) * 2 +
+           n_elems * (sizeof(UnsignedInt) + sizeof(double)) * 2;
+  }
+
+  // res += A * vec with A the full symmetric matrix, the transpose up to date.
+  // Each row of res is summed by one thread in a fixed order, so the result does not depend on
+  // the number of threads.
+  template <class T>
+  void multiply_symmetric(const std::vector<double>& vec, std::vector<T>& res) const {
+    const std::size_t ROWS_PER_CHUNK = 64;
+    const std::size_t n_rows = get_n_rows();
+    assert(transpose_row_offsets.size() == n_rows + 1);
+#pragma omp parallel for schedule(static, ROWS_PER_CHUNK)
+    for (std::size_t i = 0; i < n_rows; i++) {
+      for (std::size_t k = row_offsets[i]; k < row_offsets[i + 1]; k++) {
+        res[i] += values[k] * vec[col_ids[k]];
+      }
+      for (std::size_t k = transpose_row_offsets[i]; k < transpose_row_offsets[i + 1]; k++) {
+        res[i] += transpose_values[k] * vec[transpose_col_ids[k]];
+      }
+    }
+  }
+
+  void clear() {
+    row_offsets.assign(1, 0);
+    col_ids.clear();
+    values.clear();
+    col_ids.shrink_to_fit();
+    values.shrink_to_fit();
+    transpose_row_offsets.assign(1, 0);
+    transpose_col_ids.clear();
+    transpose_values.clear();
+    transpose_col_ids.shrink_to_fit();
+    transpose_values.shrink_to_fit();
+  }
+
+ private:
+  std::vector<std::size_t> row_offsets;
+  std::vector<UnsignedInt> col_ids;
+  std::vector<double> values;
+  std::vector<std::size_t> transpose_row_offsets;
+  std::vector<UnsignedInt> transpose_col_ids;
+  std::vector<double> transpose_values;
+};
+
+#endif
@@ -0,0 +1,44 @@
+#include "sparse_matrix.h"
+#include "gtest/gtest.h"
+
+TEST(SparseMatrixTest, MultiplySymmetric) {
+  // [[1, 2, 0], [2, 3, 4], [0, 4, 5]] from its upper triangle.
+  SparseMatrix matrix;
+  matrix.append_elem(0, 1.0);
+  matrix.append_elem(1, 2.0);
+  matrix.end_row();
+  matrix.append_elem(2, 4.0);
+  matrix.append_elem(1, 3.0);
+  matrix.end_row();
+  matrix.append_elem(2, 5.0);
+  matrix.end_row();
+  EXPECT_EQ(matrix.get_n_rows(), 3);
+  EXPECT_EQ(matrix.get_n_elems(), 5);
+
+  matrix.update_transpose();
+
+  const std::vector<double> vec({1.0, 2.0, 3.0});
+  std::vector<double> res(3, 0.0);
+  matrix.multiply_symmetric(vec, res);
+  EXPECT_DOUBLE_EQ(res[0], 5.0);
+  EXPECT_DOUBLE_EQ(res[1], 20.0);
+  EXPECT_DOUBLE_EQ(res[2], 23.0);
+
+  // Extended with a fourth row [1, 0, 6, 7].
+  matrix.append_elem(3, 7.0);
+  matrix.append_elem(0, 1.0);
+  matrix.append_elem(2, 6.0);
+  matrix.end_row();
+  matrix.update_transpose();
+  const std::vector<double> vec4({1.0, 2.0, 3.0, 4.0});
+  std::vector<double> res4(4, 0.0);
+  matrix.multiply_symmetric(vec4, res4);
+  EXPECT_DOUBLE_EQ(res4[0], 9.0);
+  EXPECT_DOUBLE_EQ(res4[1], 20.0);
+  EXPECT_DOUBLE_EQ(res4[2], 47.0);
+  EXPECT_DOUBLE_EQ(res4[3], 47.0);
+
+  matrix.clear();
+  EXPECT_EQ(matrix.get_n_rows(), 0);
+  EXPECT_EQ(matrix.get_n_elems(), 0);
+}
@@ -12,6 +12,8 @@
 #include <functional>
 #include <iostream>
 #include <list>
+#include <numeric>
+#include <random>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -16,6 +16,5 @@ typedef std::vector<int> Ints;
 typedef std::vector<UnsignedInt> UnsignedInts;
 typedef std::vector<Orbital> Orbitals;
 typedef std::pair<Orbitals, Orbitals> OrbitalsPair;
-typedef std::pair<OrbitalsPair, PTCategory> PTKey;
 
 #endif
\ No newline at end of file
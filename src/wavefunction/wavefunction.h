@@ -1,50 +1,141 @@
 #ifndef HCI_WAVEFUNCTION_H_
 #define HCI_WAVEFUNCTION_H_
 
+#include <boost/functional/hash.hpp>
 #include "../std.h"
 
 #include "../det/det.h"
-#include "term.h"
+#include "../types.h"
 
+// Structure of arrays storage so that dets and coefs can be passed around without copies.
+// Each det is packed as the ids of its up and dn strings, interned in one table shared by both
+// spins, and rebuilt on access. These ids are the only copy of the dets held by every process.
 class Wavefunction {
  private:
-  std::list<Term> terms;
+  // Dense ids of the distinct spin strings, and the strings by id pointing to the keys.
+  std::unordered_map<Orbitals, UnsignedInt, boost::hash<Orbitals>> string_ids;
+  std::vector<const Orbitals*> strings;
+
+  std::vector<UnsignedInt> up_ids;
+  std::vector<UnsignedInt> dn_ids;
+  std::vector<double> coefs;
+
+  void index_strings() {
+    strings.assign(string_ids.size(), nullptr);
+    for (const auto& kv : string_ids) strings[kv.second] = &kv.first;
+  }
+
+  UnsignedInt get_string_id(const Orbitals& string) {
+    const auto& it = string_ids.find(string);
+    if (it != string_ids.end()) return it->second;
+    const UnsignedInt string_id = static_cast<UnsignedInt>(strings.size());
+    strings.push_back(&string_ids.emplace(string, string_id).first->first);
+    return string_id;
+  }
 
  public:
   Wavefunction() {}
 
-  std::size_t size() { return terms.size(); }
+  // The strings of a copy point into its own string_ids.
+  Wavefunction(const Wavefunction& rhs)
+      : string_ids(rhs.string_ids), up_ids(rhs.up_ids), dn_ids(rhs.dn_ids), coefs(rhs.coefs) {
+    index_strings();
+  }
 
-  void append_term(const Det& det, const double coef) { terms.push_back(Term(det, coef)); }
+  Wavefunction& operator=(const Wavefunction& rhs) {
+    string_ids = rhs.string_ids;
+    up_ids = rhs.up_ids;
+    dn_ids = rhs.dn_ids;
+    coefs = rhs.coefs;
+    index_strings();
+    return *this;
+  }
 
-  const std::list<Term>& get_terms() const { return terms; }
+  std::size_t size() const { return coefs.size(); }
 
-  Det& get_last_det() { return terms.back().det; }
+  void reserve(const std::size_t n) {
+    up_ids.reserve(n);
+    dn_ids.reserve(n);
+    coefs.reserve(n);
+  }
 
-  void set_coefs(const std::vector<double>& coefs) {
-    std::size_t i = 0;
-    for (auto& term : terms) term.coef = coefs[i++];
+  void append_term(const Det& det, const double coef) {
+    up_ids.push_back(get_string_id(det.up.get_elec_orbs()));
+    dn_ids.push_back(get_string_id(det.dn.get_elec_orbs()));
+    coefs.push_back(coef);
+  }
+
+  // Det i rebuilt from its strings, reusing the storage of det.
+  void get_det(const std::size_t i, Det& det) const {
+    det.up.decode(*strings[up_ids[i]], SpinDet::FIXED);
+    det.dn.decode(*strings[dn_ids[i]], SpinDet::FIXED);
   }
 
-  std::vector<Det> get_dets() const {
-    std::vector<Det> dets;
-    dets.reserve(terms.size());
-    for (const auto& term : terms) dets.push_back(term.det);
-    return dets;
+  Det get_det(const std::size_t i) const {
+    Det det;
+    get_det(i, det);
+    return det;
   }
 
-  std::vector<double> get_coefs() const {
-    std::vector<double> coefs;
-    coefs.reserve(terms.size());
-    for (const auto& term : terms) coefs.push_back(term.coef);
-    return coefs;
+  UnsignedInt get_up_id(const std::size_t i) const { return up_ids[i]; }
+
+  UnsignedInt get_dn_id(const std::size_t i) const { return dn_ids[i]; }
+
+  // Ids are dense and assigned in order of appearance, kept until clear.
+  std::size_t get_n_strings() const { return strings.size(); }
+
+  const Orbitals& get_string(const UnsignedInt string_id) const { return *strings[string_id]; }
+
+  // Id of the string, or get_n_strings() if no det has it.
+  UnsignedInt find_string_id(const Orbitals& string) const {
+    const auto& it = string_ids.find(string);
+    return it == string_ids.end() ? static_cast<UnsignedInt>(strings.size()) : it->second;
   }
 
+  const std::vector<double>& get_coefs() const { return coefs; }
+
+  void set_coefs(const std::vector<double>& coefs) {
+    assert(coefs.size() == size());
+    this->coefs = coefs;
+  }
+
+  // Stable sort by decreasing magnitude of coefs.
   void sort_by_coefs() {
-    terms.sort([](const Term& a, const Term& b) -> bool { return fabs(a.coef) > fabs(b.coef); });
+    const std::size_t n = size();
+    std::vector<std::size_t> order(n);
+    for (std::size_t i = 0; i < n; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](const std::size_t a, const std::size_t b) {
+      return fabs(coefs[a]) > fabs(coefs[b]);
+    });
+    permute(order);
   }
 
-  void clear() { terms.clear(); }
+  // Reorder terms so that the i-th term becomes the order[i]-th term of the original.
+  // The strings keep their ids.
+  void permute(const std::vector<std::size_t>& order) {
+    std::vector<UnsignedInt> up_ids_new;
+    std::vector<UnsignedInt> dn_ids_new;
+    std::vector<double> coefs_new;
+    up_ids_new.reserve(order.size());
+    dn_ids_new.reserve(order.size());
+    coefs_new.reserve(order.size());
+    for (const std::size_t i : order) {
+      up_ids_new.push_back(up_ids[i]);
+      dn_ids_new.push_back(dn_ids[i]);
+      coefs_new.push_back(coefs[i]);
+    }
+    up_ids.swap(up_ids_new);
+    dn_ids.swap(dn_ids_new);
+    coefs.swap(coefs_new);
+  }
+
+  void clear() {
+    string_ids.clear();
+    strings.clear();
+    up_ids.clear();
+    dn_ids.clear();
+    coefs.clear();
+  }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,35 @@
+#include "wavefunction.h"
+#include "gtest/gtest.h"
+
+TEST(WavefunctionTest, PackedDetsAndSort) {
+  Det det1, det2;
+  det1.up.set_orb(0, true);
+  det1.dn.set_orb(0, true);
+  det2.up.set_orb(0, true);
+  det2.dn.set_orb(1, true);
+  Wavefunction wf;
+  wf.append_term(det1, 0.1);
+  wf.append_term(det2, -0.9);
+  EXPECT_EQ(wf.size(), 2);
+  wf.sort_by_coefs();
+  EXPECT_EQ(wf.get_det(0), det2);
+  EXPECT_EQ(wf.get_det(1), det1);
+  EXPECT_EQ(wf.get_coefs()[0], -0.9);
+
+  // The strings are shared by both spins.
+  EXPECT_EQ(wf.get_n_strings(), 2);
+  EXPECT_EQ(wf.get_up_id(0), wf.get_up_id(1));
+  EXPECT_EQ(wf.get_dn_id(1), wf.get_up_id(1));
+  EXPECT_EQ(wf.get_string(wf.get_dn_id(0)), det2.dn.get_elec_orbs());
+  EXPECT_EQ(wf.find_string_id(det2.dn.get_elec_orbs()), wf.get_dn_id(0));
+  Det det3;
+  det3.up.set_orb(2, true);
+  EXPECT_EQ(wf.find_string_id(det3.up.get_elec_orbs()), wf.get_n_strings());
+
+  // A copy rebuilds the dets from its own strings.
+  Wavefunction wf_copy(wf);
+  wf.clear();
+  Det det;
+  wf_copy.get_det(1, det);
+  EXPECT_EQ(det, det1);
+}